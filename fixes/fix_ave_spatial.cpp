@@ -19,10 +19,22 @@
    Modifications for writing in TecPlot data format were done by Kirill Lykov
    For details, see 
    http://kirilllykov.github.com/blog/2012/12/20/lammps-data-formats-into-tecplot-ascii-data-format/
+
+   If output file has extension *.bin, frames are written in binary
+   with collective MPI-IO, every proc writes its contiguous range of bins:
+     header: char[8] "LMPAVSP1", int64 ndim, nvalues, nbins,
+             nlayers[3], double offset[3], delta[3]
+     frame:  int64 timestep, nbins x (count, values) as double
+   bins are ordered as in text output, coord of bin is offset+(i+0.5)*delta
+   file.bin.idx lists frame number, timestep and byte offset of each frame
+   (only of the last one with overwrite), file is synced at the end of a run
 ------------------------------------------------------------------------- */
 
 #include "stdlib.h"
 #include "string.h"
+#include "math.h"
+#include "ctype.h"
+#include "unistd.h"
 #include "fix_ave_spatial.h"
 #include "atom.h"
 #include "update.h"
@@ -36,6 +48,9 @@
 #include "variable.h"
 #include "memory.h"
 #include "error.h"
+#include "../utils/multi_tau_correlator.h"
+#include <vector>
+#include <string>
 
 using namespace LAMMPS_NS;
 using namespace FixConst;
@@ -45,9 +60,11 @@ enum{V,F,DENSITY_NUMBER,DENSITY_MASS,COMPUTE,FIX,VARIABLE};
 enum{SAMPLE,ALL};
 enum{BOX,LATTICE,REDUCED};
 enum{ONE,RUNNING,WINDOW};
+enum{NOFILTER,NONZERO,MINCOUNT,REGIONFILTER};
 
 #define INVOKED_PERATOM 8
 #define BIG 1000000000
+#define BINHEADER 104
 
 static const char* get_filename_ext(const char *filename) {
   const char *dot = strrchr(filename, '.');
@@ -58,7 +75,7 @@ static const char* get_filename_ext(const char *filename) {
 /* ---------------------------------------------------------------------- */
 
 FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
-  Fix(lmp, narg, arg), isTecFile(false)
+  Fix(lmp, narg, arg), isTecFile(false), isBinFile(false)
 {
   if (narg < 6) error->all(FLERR,"Illegal fix ave/spatial command");
 
@@ -175,9 +192,20 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
   regionflag = 0;
   idregion = NULL;
   fp = NULL;
+  fpindex = NULL;
+  indexpos = 0;
   ave = ONE;
   nwindow = 0;
+  wfloat = 0;
   overwrite = 0;
+  ncorr = 0;
+  corrcol = NULL;
+  fpcorr = NULL;
+  corrfreq = 0;
+  filterflag = NOFILTER;
+  filtercount = 0.0;
+  idfilter = NULL;
+  filterregion = NULL;
   char *title1 = NULL;
   char *title2 = NULL;
   char *title3 = NULL;
@@ -215,7 +243,29 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
         isTecFile = true;
       }
 
-      if (me == 0) {
+      // binary file is opened by all procs for collective writes
+
+      if (ext != 0 && strcmp(ext,"bin") == 0) {
+        isBinFile = true;
+        if (MPI_File_open(world,arg[iarg+1],MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                          MPI_INFO_NULL,&mpifh) != MPI_SUCCESS) {
+          char str[128];
+          sprintf(str,"Cannot open fix ave/spatial binary file %s",arg[iarg+1]);
+          error->all(FLERR,str);
+        }
+        MPI_File_set_size(mpifh,0);
+        if (me == 0) {
+          std::string indexname = std::string(arg[iarg+1]) + ".idx";
+          fpindex = fopen(indexname.c_str(),"w");
+          if (fpindex == NULL) {
+            char str[128];
+            sprintf(str,"Cannot open fix ave/spatial file %s",indexname.c_str());
+            error->one(FLERR,str);
+          }
+          fprintf(fpindex,"# Frame Timestep Offset\n");
+          indexpos = ftell(fpindex);
+        }
+      } else if (me == 0) {
         fp = fopen(arg[iarg+1],"w");
         if (fp == NULL) {
           char str[128];
@@ -237,9 +287,73 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
       }
       iarg += 2;
       if (ave == WINDOW) iarg++;
+    } else if (strcmp(arg[iarg],"wstore") == 0) {
+      if (iarg+2 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+      if (strcmp(arg[iarg+1],"double") == 0) wfloat = 0;
+      else if (strcmp(arg[iarg+1],"float") == 0) wfloat = 1;
+      else error->all(FLERR,"Illegal fix ave/spatial command");
+      iarg += 2;
     } else if (strcmp(arg[iarg],"overwrite") == 0) {
       overwrite = 1;
       iarg += 1;
+    } else if (strcmp(arg[iarg],"filter") == 0) {
+      if (iarg+2 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+      if (strcmp(arg[iarg+1],"nonzero") == 0) {
+        filterflag = NONZERO;
+        iarg += 2;
+      } else if (strcmp(arg[iarg+1],"count") == 0) {
+        if (iarg+3 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+        filterflag = MINCOUNT;
+        filtercount = atof(arg[iarg+2]);
+        iarg += 3;
+      } else if (strcmp(arg[iarg+1],"region") == 0) {
+        if (iarg+3 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+        if (domain->find_region(arg[iarg+2]) == -1)
+          error->all(FLERR,"Region ID for fix ave/spatial does not exist");
+        filterflag = REGIONFILTER;
+        delete [] idfilter;
+        int n = strlen(arg[iarg+2]) + 1;
+        idfilter = new char[n];
+        strcpy(idfilter,arg[iarg+2]);
+        iarg += 3;
+      } else error->all(FLERR,"Illegal fix ave/spatial command");
+    } else if (strcmp(arg[iarg],"correlate") == 0) {
+      if (iarg+6 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+      if (me == 0) {
+        if (fpcorr) fclose(fpcorr);
+        fpcorr = fopen(arg[iarg+1],"w");
+        if (fpcorr == NULL) {
+          char str[128];
+          sprintf(str,"Cannot open fix ave/spatial correlate file %s",
+                  arg[iarg+1]);
+          error->one(FLERR,str);
+        }
+      }
+      corr_p = atoi(arg[iarg+2]);
+      corr_m = atoi(arg[iarg+3]);
+      corr_nlevels = atoi(arg[iarg+4]);
+      if (corr_m <= 0 || corr_p < corr_m || corr_p % corr_m ||
+          corr_nlevels <= 0)
+        error->all(FLERR,"Illegal fix ave/spatial command");
+      iarg += 5;
+      delete [] corrcol;
+      corrcol = new int[nvalues];
+      ncorr = 0;
+      while (iarg < narg && isdigit(arg[iarg][0])) {
+        if (ncorr == nvalues)
+          error->all(FLERR,"Illegal fix ave/spatial command");
+        corrcol[ncorr] = atoi(arg[iarg]) - 1;
+        if (corrcol[ncorr] < 0 || corrcol[ncorr] >= nvalues)
+          error->all(FLERR,"Illegal fix ave/spatial command");
+        ncorr++;
+        iarg++;
+      }
+      if (ncorr == 0) error->all(FLERR,"Illegal fix ave/spatial command");
+    } else if (strcmp(arg[iarg],"corrfreq") == 0) {
+      if (iarg+2 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
+      corrfreq = atoi(arg[iarg+1]);
+      if (corrfreq < 0) error->all(FLERR,"Illegal fix ave/spatial command");
+      iarg += 2;
     } else if (strcmp(arg[iarg],"title1") == 0) {
       if (iarg+2 > narg) error->all(FLERR,"Illegal fix ave/spatial command");
       delete [] title1;
@@ -277,6 +391,16 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
     error->all(FLERR,"Illegal fix ave/spatial command");
   if (ave != RUNNING && overwrite)
     error->all(FLERR,"Illegal fix ave/spatial command");
+  if (ave != WINDOW && wfloat)
+    error->all(FLERR,"Illegal fix ave/spatial command");
+  if (filterflag != NOFILTER && isBinFile)
+    error->all(FLERR,"Illegal fix ave/spatial command");
+  if (filterflag == REGIONFILTER && ndim != 3)
+    error->all(FLERR,"Fix ave/spatial filter region requires 3d bins");
+  if (ncorr && nevery*nrepeat != nfreq)
+    error->all(FLERR,"Fix ave/spatial correlate requires nevery*nrepeat = nfreq");
+  if (corrfreq % nfreq)
+    error->all(FLERR,"Fix ave/spatial corrfreq must be a multiple of nfreq");
 
   for (int i = 0; i < nvalues; i++) {
     if (which[i] == COMPUTE) {
@@ -338,7 +462,9 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
       for (int i = 0; i < nvalues; i++) fprintf(fp," %s",arg[6+3*ndim+i]);
       fprintf(fp,"\n");
       if (isTecFile && ndim == 3) { //TODO this code will work only with data in specified order
-        fprintf(fp,"VARIABLES = \"X\", \"Y\", \"Z\", \"N\", \"VX\", \"VY\", \"VZ\", \"D\"\n");
+        fprintf(fp,"VARIABLES = \"X\", \"Y\", \"Z\", \"N\", \"VX\", \"VY\", \"VZ\", \"D\"");
+        if (filterflag != NOFILTER) fprintf(fp,", \"BIN\", \"SELECTED\"");
+        fprintf(fp,"\n");
       }
     }
     filepos = ftell(fp);
@@ -402,6 +528,19 @@ FixAveSpatial::FixAveSpatial(LAMMPS *lmp, int narg, char **arg) :
   count_list = NULL;
   values_one = values_many = values_sum = values_total = NULL;
   values_list = NULL;
+  count_flist = NULL;
+  values_flist = NULL;
+  count_comp = NULL;
+  values_comp = NULL;
+
+  corr_nsample = 0;
+  corr_one = corr_all = corr_sample = NULL;
+  correlator = NULL;
+
+  nframes = 0;
+  binbins = 0;
+  maxslab = 0;
+  slab = NULL;
 
   // nvalid = next step on which end_of_step does something
   // add nvalid to all computes that store invocation times
@@ -422,8 +561,14 @@ FixAveSpatial::~FixAveSpatial()
   delete [] ids;
   delete [] value2index;
   delete [] idregion;
+  delete [] idfilter;
 
   if (fp && me == 0) fclose(fp);
+  if (fpindex && me == 0) fclose(fpindex);
+  if (isBinFile) MPI_File_close(&mpifh);
+  if (fpcorr && me == 0) fclose(fpcorr);
+  delete [] corrcol;
+  delete correlator;
 
   memory->destroy(varatom);
   memory->destroy(bin);
@@ -439,6 +584,14 @@ FixAveSpatial::~FixAveSpatial()
   memory->destroy(values_sum);
   memory->destroy(values_total);
   memory->destroy(values_list);
+  memory->destroy(count_flist);
+  memory->destroy(values_flist);
+  memory->destroy(count_comp);
+  memory->destroy(values_comp);
+  memory->destroy(corr_one);
+  memory->destroy(corr_all);
+  memory->destroy(corr_sample);
+  memory->destroy(slab);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -463,9 +616,16 @@ void FixAveSpatial::init()
     region = domain->regions[iregion];
   }
 
+  if (filterflag == REGIONFILTER) {
+    int ifilter = domain->find_region(idfilter);
+    if (ifilter == -1)
+      error->all(FLERR,"Region ID for fix ave/spatial does not exist");
+    filterregion = domain->regions[ifilter];
+  }
+
   // # of bins cannot vary for ave = RUNNING or WINDOW
 
-  if (ave == RUNNING || ave == WINDOW) {
+  if (ave == RUNNING || ave == WINDOW || ncorr) {
     if (scaleflag != REDUCED && domain->box_change)
       error->all(FLERR,"Fix ave/spatial settings invalid with changing box");
   }
@@ -700,6 +860,10 @@ void FixAveSpatial::end_of_step()
     }
   }
 
+  // feed the reduced sample to the time correlator
+
+  if (ncorr) correlate_sample();
+
   // process a single sample
   // if normflag = ALL, accumulate values,count separately to many
   // if normflag = SAMPLE, one = value/count, accumulate one to many
@@ -743,37 +907,59 @@ void FixAveSpatial::end_of_step()
   // if normflag = SAMPLE, final is sum of ave / repeat
   // exception is densities: normalized by repeat, not total count
 
+  // if ave = WINDOW, only proc 0 needs the sums, it updates the window
+  // history and broadcasts the new totals below
+
   double repeat = nrepeat;
   double mv2d = force->mv2d;
+  int rootonly = (ave == WINDOW);
+  int normalize = (!rootonly || me == 0);
 
   if (normflag == ALL) {
-    MPI_Allreduce(count_many,count_sum,nbins,MPI_DOUBLE,MPI_SUM,world);
-    MPI_Allreduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
-                  MPI_DOUBLE,MPI_SUM,world);
-    for (m = 0; m < nbins; m++) {
-      if (count_sum[m] > 0.0)
-        for (j = 0; j < nvalues; j++)
-          if (which[j] == DENSITY_NUMBER) values_sum[m][j] /= repeat;
-          else if (which[j] == DENSITY_MASS) values_sum[m][j] *= mv2d/repeat;
-          else values_sum[m][j] /= count_sum[m];
-      count_sum[m] /= repeat;
+    if (rootonly) {
+      MPI_Reduce(count_many,count_sum,nbins,MPI_DOUBLE,MPI_SUM,0,world);
+      MPI_Reduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
+                 MPI_DOUBLE,MPI_SUM,0,world);
+    } else {
+      MPI_Allreduce(count_many,count_sum,nbins,MPI_DOUBLE,MPI_SUM,world);
+      MPI_Allreduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
+                    MPI_DOUBLE,MPI_SUM,world);
+    }
+    if (normalize) {
+      for (m = 0; m < nbins; m++) {
+        if (count_sum[m] > 0.0)
+          for (j = 0; j < nvalues; j++) {
+            if (which[j] == DENSITY_NUMBER) values_sum[m][j] /= repeat;
+            else if (which[j] == DENSITY_MASS) values_sum[m][j] *= mv2d/repeat;
+            else values_sum[m][j] /= count_sum[m];
+          }
+        count_sum[m] /= repeat;
+      }
     }
   } else {
-    MPI_Allreduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
-                  MPI_DOUBLE,MPI_SUM,world);
-    for (m = 0; m < nbins; m++) {
-      for (j = 0; j < nvalues; j++)
-        values_sum[m][j] /= repeat;
-      count_sum[m] /= repeat;
+    if (rootonly)
+      MPI_Reduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
+                 MPI_DOUBLE,MPI_SUM,0,world);
+    else
+      MPI_Allreduce(&values_many[0][0],&values_sum[0][0],nbins*nvalues,
+                    MPI_DOUBLE,MPI_SUM,world);
+    if (normalize) {
+      for (m = 0; m < nbins; m++) {
+        for (j = 0; j < nvalues; j++)
+          values_sum[m][j] /= repeat;
+        count_sum[m] /= repeat;
+      }
     }
   }
 
   // density is additionally normalized by bin volume
 
-  for (j = 0; j < nvalues; j++)
-    if (which[j] == DENSITY_NUMBER || which[j] == DENSITY_MASS)
-      for (m = 0; m < nbins; m++)
-        values_sum[m][j] /= bin_volume;
+  if (normalize) {
+    for (j = 0; j < nvalues; j++)
+      if (which[j] == DENSITY_NUMBER || which[j] == DENSITY_MASS)
+        for (m = 0; m < nbins; m++)
+          values_sum[m][j] /= bin_volume;
+  }
 
   // if ave = ONE, only single Nfreq timestep value is needed
   // if ave = RUNNING, combine with all previous Nfreq timestep values
@@ -796,16 +982,9 @@ void FixAveSpatial::end_of_step()
     norm++;
 
   } else if (ave == WINDOW) {
-    for (m = 0; m < nbins; m++) {
-      for (i = 0; i < nvalues; i++) {
-        values_total[m][i] += values_sum[m][i];
-        if (window_limit) values_total[m][i] -= values_list[iwindow][m][i];
-        values_list[iwindow][m][i] = values_sum[m][i];
-      }
-      count_total[m] += count_sum[m];
-      if (window_limit) count_total[m] -= count_list[iwindow][m];
-      count_list[iwindow][m] = count_sum[m];
-    }
+    if (me == 0) update_window();
+    MPI_Bcast(count_total,nbins,MPI_DOUBLE,0,world);
+    MPI_Bcast(&values_total[0][0],nbins*nvalues,MPI_DOUBLE,0,world);
 
     iwindow++;
     if (iwindow == nwindow) {
@@ -818,18 +997,31 @@ void FixAveSpatial::end_of_step()
 
   // output result to file
 
+  if (isBinFile) write_binary(ntimestep);
+
   if (fp && me == 0) {
     if (overwrite) fseek(fp,filepos,SEEK_SET);
-    if (isTecFile && ndim == 3) {
 
-      fprintf(fp,"ZONE I=%d,J=%d,K=%d  F=POINT\n", nlayers[2], nlayers[1], nlayers[0]);
+    // with a filter only selected bins are written
+    // Tecplot zone stays ordered over all bins, so it can be plotted as a field,
+    // bins which are not selected are blanked with value blanking on SELECTED == 0
+
+    int nout = nbins;
+    if (filterflag != NOFILTER) {
+      nout = 0;
+      for (m = 0; m < nbins; m++)
+        if (bin_selected(m)) nout++;
+    }
 
+    if (isTecFile && ndim == 3) {
+      fprintf(fp,"ZONE I=%d,J=%d,K=%d  F=POINT\n", nlayers[2], nlayers[1], nlayers[0]);
     } else {
-      fprintf(fp,BIGINT_FORMAT " %d\n",ntimestep,nbins);
+      fprintf(fp,BIGINT_FORMAT " %d\n",ntimestep,nout);
     }
 
     if (ndim == 1)
       for (m = 0; m < nbins; m++) {
+        if (!bin_selected(m)) continue;
         fprintf(fp,"  %d %g %g",m+1,coord[m][0],
                 count_total[m]/norm);
         for (i = 0; i < nvalues; i++)
@@ -838,6 +1030,7 @@ void FixAveSpatial::end_of_step()
       }
     else if (ndim == 2)
       for (m = 0; m < nbins; m++) {
+        if (!bin_selected(m)) continue;
         fprintf(fp,"  %d %g %g %g",m+1,coord[m][0],coord[m][1],
                 count_total[m]/norm);
         for (i = 0; i < nvalues; i++)
@@ -851,10 +1044,12 @@ void FixAveSpatial::end_of_step()
                   count_total[m]/norm);
           for (i = 0; i < nvalues; i++)
             fprintf(fp," %g",values_total[m][i]/norm);
+          if (filterflag != NOFILTER) fprintf(fp," %d %d",m+1,bin_selected(m));
           fprintf(fp,"\n");
         }
       } else {
         for (m = 0; m < nbins; m++) {
+          if (!bin_selected(m)) continue;
           fprintf(fp,"  %d %g %g %g %g",m+1,coord[m][0],coord[m][1],coord[m][2],
                   count_total[m]/norm);
           for (i = 0; i < nvalues; i++)
@@ -864,7 +1059,27 @@ void FixAveSpatial::end_of_step()
       }
     }
     fflush(fp);
+
+    // overwritten frame may be shorter than the previous one
+
+    if (overwrite && ftruncate(fileno(fp),ftell(fp)) != 0)
+      error->warning(FLERR,"Could not truncate fix ave/spatial file");
   }
+
+  // correlation file is O(nbins*lags), it is written at the end of the run
+  // and optionally every corrfreq steps
+
+  if (ncorr && corrfreq && ntimestep % corrfreq == 0) write_correlation(ntimestep);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixAveSpatial::post_run()
+{
+  // binary frames are synced once per run, the file is closed in destructor
+
+  if (isBinFile) MPI_File_sync(mpifh);
+  if (ncorr) write_correlation(update->ntimestep);
 }
 
 /* ----------------------------------------------------------------------
@@ -943,11 +1158,8 @@ void FixAveSpatial::setup_bins()
 
     // only allocate count and values list for ave = WINDOW
 
-    if (ave == WINDOW) {
-      memory->create(count_list,nwindow,nbins,"ave/spatial:count_list");
-      memory->create(values_list,nwindow,nbins,nvalues,
-                     "ave/spatial:values_list");
-    }
+    if (ave == WINDOW) allocate_window();
+    if (ncorr) allocate_correlator();
 
     // reinitialize regrown count/values total since they accumulate
 
@@ -989,6 +1201,328 @@ void FixAveSpatial::setup_bins()
   }
 }
 
+/* ----------------------------------------------------------------------
+   allocate window history for ave = WINDOW
+   only proc 0 keeps it, other procs receive the totals via broadcast
+   history is stored in float if wstore = float
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::allocate_window()
+{
+  if (me != 0) return;
+
+  memory->destroy(count_list);
+  memory->destroy(values_list);
+  memory->destroy(count_flist);
+  memory->destroy(values_flist);
+  count_list = NULL;
+  values_list = NULL;
+  count_flist = NULL;
+  values_flist = NULL;
+
+  if (wfloat) {
+    memory->create(count_flist,nwindow,nbins,"ave/spatial:count_flist");
+    memory->create(values_flist,nwindow,nbins,nvalues,
+                   "ave/spatial:values_flist");
+  } else {
+    memory->create(count_list,nwindow,nbins,"ave/spatial:count_list");
+    memory->create(values_list,nwindow,nbins,nvalues,
+                   "ave/spatial:values_list");
+  }
+
+  memory->destroy(count_comp);
+  memory->destroy(values_comp);
+  memory->create(count_comp,nbins,"ave/spatial:count_comp");
+  memory->create(values_comp,nbins,nvalues,"ave/spatial:values_comp");
+  for (int m = 0; m < nbins; m++) {
+    count_comp[m] = 0.0;
+    for (int i = 0; i < nvalues; i++) values_comp[m][i] = 0.0;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   add compensated (Kahan) increment to a running window total
+------------------------------------------------------------------------- */
+
+static inline void window_add(double &total, double &comp, double increment)
+{
+  double y = increment - comp;
+  double t = total + y;
+  comp = (t - total) - y;
+  total = t;
+}
+
+/* ----------------------------------------------------------------------
+   update window totals incrementally on proc 0
+   add newest Nfreq sample, subtract the one it replaces in the history
+   with float history the stored (rounded) sample is added, so that
+   the later subtraction removes exactly what was added
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::update_window()
+{
+  int i,m;
+  double value;
+
+  if (wfloat) {
+    float *fcount = count_flist[iwindow];
+    float **fvalues = values_flist[iwindow];
+    for (m = 0; m < nbins; m++) {
+      for (i = 0; i < nvalues; i++) {
+        value = static_cast<float>(values_sum[m][i]);
+        if (window_limit) value -= fvalues[m][i];
+        window_add(values_total[m][i],values_comp[m][i],value);
+        fvalues[m][i] = static_cast<float>(values_sum[m][i]);
+      }
+      value = static_cast<float>(count_sum[m]);
+      if (window_limit) value -= fcount[m];
+      window_add(count_total[m],count_comp[m],value);
+      fcount[m] = static_cast<float>(count_sum[m]);
+    }
+  } else {
+    double *dcount = count_list[iwindow];
+    double **dvalues = values_list[iwindow];
+    for (m = 0; m < nbins; m++) {
+      for (i = 0; i < nvalues; i++) {
+        value = values_sum[m][i];
+        if (window_limit) value -= dvalues[m][i];
+        window_add(values_total[m][i],values_comp[m][i],value);
+        dvalues[m][i] = values_sum[m][i];
+      }
+      value = count_sum[m];
+      if (window_limit) value -= dcount[m];
+      window_add(count_total[m],count_comp[m],value);
+      dcount[m] = count_sum[m];
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------
+   allocate buffers for correlate, correlator itself lives on proc 0 only
+   each bin and correlated value is an independent correlator channel
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::allocate_correlator()
+{
+  memory->destroy(corr_one);
+  memory->create(corr_one,nbins*(ncorr+1),"ave/spatial:corr_one");
+
+  if (me != 0) return;
+
+  memory->destroy(corr_all);
+  memory->create(corr_all,nbins*(ncorr+1),"ave/spatial:corr_all");
+  memory->destroy(corr_sample);
+  memory->create(corr_sample,nbins*ncorr,"ave/spatial:corr_sample");
+  delete correlator;
+  correlator = new MultiTauCorrelator(nbins*ncorr,corr_p,corr_m,corr_nlevels);
+  corr_nsample = 0;
+}
+
+/* ----------------------------------------------------------------------
+   reduce counts and correlated values of one sample to proc 0
+   normalize them same way as the time average and add to the correlator
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::correlate_sample()
+{
+  int m,k;
+  int stride = ncorr + 1;
+
+  for (m = 0; m < nbins; m++) {
+    corr_one[m*stride] = count_one[m];
+    for (k = 0; k < ncorr; k++)
+      corr_one[m*stride+1+k] = values_one[m][corrcol[k]];
+  }
+  MPI_Reduce(corr_one,corr_all,nbins*stride,MPI_DOUBLE,MPI_SUM,0,world);
+
+  if (me != 0) return;
+
+  double mv2d = force->mv2d;
+  for (m = 0; m < nbins; m++) {
+    double count = corr_all[m*stride];
+    for (k = 0; k < ncorr; k++) {
+      double value = corr_all[m*stride+1+k];
+      int j = corrcol[k];
+      if (which[j] == DENSITY_NUMBER) value /= bin_volume;
+      else if (which[j] == DENSITY_MASS) value *= mv2d/bin_volume;
+      else if (count > 0.0) value /= count;
+      else value = 0.0;
+      corr_sample[m*ncorr+k] = value;
+    }
+  }
+  correlator->add(corr_sample);
+  corr_nsample++;
+}
+
+/* ----------------------------------------------------------------------
+   rewrite correlate file with the current estimate of C(bin,lag)
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::write_correlation(bigint ntimestep)
+{
+  if (me != 0 || fpcorr == NULL || correlator == NULL) return;
+
+  std::vector<long> lags;
+  std::vector<double> corr;
+  correlator->getLags(lags);
+  correlator->getCorrelation(corr);
+
+  fseek(fpcorr,0,SEEK_SET);
+  fprintf(fpcorr,"# Time correlation <A(bin,t0) A(bin,t0+lag)> for fix %s\n",id);
+  fprintf(fpcorr,"# Timestep Number-of-samples Number-of-lags\n");
+  fprintf(fpcorr,BIGINT_FORMAT " " BIGINT_FORMAT " %d\n",
+          ntimestep,corr_nsample,(int) lags.size());
+  fprintf(fpcorr,"# Lag Bin Coords Values\n");
+
+  for (size_t l = 0; l < lags.size(); l++) {
+    const double *c = &corr[l*nbins*ncorr];
+    for (int m = 0; m < nbins; m++) {
+      fprintf(fpcorr,"%ld %d",lags[l]*nevery,m+1);
+      for (int k = 0; k < ndim; k++) fprintf(fpcorr," %g",coord[m][k]);
+      for (int k = 0; k < ncorr; k++) fprintf(fpcorr," %g",c[m*ncorr+k]);
+      fprintf(fpcorr,"\n");
+    }
+  }
+  fflush(fpcorr);
+  if (ftruncate(fileno(fpcorr),ftell(fpcorr)) != 0)
+    error->warning(FLERR,"Could not truncate fix ave/spatial correlate file");
+}
+
+/* ----------------------------------------------------------------------
+   write one frame into the binary file with collective MPI-IO
+   totals are replicated on all procs, so each proc writes its slab
+   of bins directly, no gather to proc 0 is needed
+------------------------------------------------------------------------- */
+
+void FixAveSpatial::write_binary(bigint ntimestep)
+{
+  int m,i;
+  int nprocs;
+  MPI_Comm_size(world,&nprocs);
+
+  if (binbins == 0) {
+    binbins = nbins;
+    if (me == 0) {
+      char header[BINHEADER];
+      int64_t ivalues[6] = {ndim,nvalues,nbins,1,1,1};
+      double dvalues[6] = {0.0,0.0,0.0,0.0,0.0,0.0};
+      for (m = 0; m < ndim; m++) {
+        ivalues[3+m] = nlayers[m];
+        dvalues[m] = offset[m];
+        dvalues[3+m] = delta[m];
+      }
+      memcpy(header,"LMPAVSP1",8);
+      memcpy(header+8,ivalues,sizeof(ivalues));
+      memcpy(header+8+sizeof(ivalues),dvalues,sizeof(dvalues));
+      MPI_File_write_at(mpifh,0,header,BINHEADER,MPI_CHAR,MPI_STATUS_IGNORE);
+    }
+  }
+  if (nbins != binbins)
+    error->all(FLERR,"Fix ave/spatial binary file requires constant number of bins");
+
+  int ncols = nvalues + 1;
+  MPI_Offset framesize = sizeof(int64_t) + (MPI_Offset) nbins*ncols*sizeof(double);
+  bigint iframe = overwrite ? 0 : nframes;
+  MPI_Offset framestart = BINHEADER + iframe*framesize;
+
+  int lo = static_cast<int> ((bigint) nbins*me/nprocs);
+  int hi = static_cast<int> ((bigint) nbins*(me+1)/nprocs);
+  if ((hi-lo)*ncols > maxslab) {
+    maxslab = (hi-lo)*ncols;
+    memory->destroy(slab);
+    memory->create(slab,maxslab,"ave/spatial:slab");
+  }
+
+  double *ptr = slab;
+  for (m = lo; m < hi; m++) {
+    *ptr++ = count_total[m]/norm;
+    for (i = 0; i < nvalues; i++)
+      *ptr++ = values_total[m][i]/norm;
+  }
+
+  if (me == 0) {
+    int64_t step = ntimestep;
+    MPI_File_write_at(mpifh,framestart,&step,sizeof(step),MPI_CHAR,
+                      MPI_STATUS_IGNORE);
+
+    // with overwrite the index lists only the last frame
+
+    if (overwrite) fseek(fpindex,indexpos,SEEK_SET);
+    fprintf(fpindex,BIGINT_FORMAT " " BIGINT_FORMAT " " BIGINT_FORMAT "\n",
+            iframe,ntimestep,(bigint) framestart);
+    fflush(fpindex);
+    if (overwrite && ftruncate(fileno(fpindex),ftell(fpindex)) != 0)
+      error->warning(FLERR,"Could not truncate fix ave/spatial index file");
+  }
+
+  MPI_Offset slabstart = framestart + sizeof(int64_t) +
+    (MPI_Offset) lo*ncols*sizeof(double);
+  MPI_File_write_at_all(mpifh,slabstart,slab,(hi-lo)*ncols,MPI_DOUBLE,
+                        MPI_STATUS_IGNORE);
+  nframes++;
+}
+
+/* ----------------------------------------------------------------------
+   return 1 if bin M passes the output filter, else 0
+   region filter is tested at the bin center in box coords
+------------------------------------------------------------------------- */
+
+int FixAveSpatial::bin_selected(int m)
+{
+  if (filterflag == NOFILTER) return 1;
+  if (filterflag == NONZERO) return count_total[m] > 0.0;
+  if (filterflag == MINCOUNT) return count_total[m]/norm > filtercount;
+
+  double center[3],xbox[3];
+  for (int k = 0; k < 3; k++) center[dim[k]] = coord[m][k];
+  if (scaleflag == REDUCED) domain->lamda2x(center,xbox);
+  else {
+    xbox[0] = center[0];
+    xbox[1] = center[1];
+    xbox[2] = center[2];
+  }
+  return filterregion->match(xbox[0],xbox[1],xbox[2]);
+}
+
+/* ----------------------------------------------------------------------
+   coordinate of atom along dimension idim used for binning
+   if reduced, apply inverse box transform lamda = H^-1 (x - boxlo) for
+   this component only, atom->x is never modified
+   works for orthogonal and triclinic boxes, for orthogonal boxes the
+   off-diagonal terms of h_inv are zero
+------------------------------------------------------------------------- */
+
+static inline double bin_coord(const double *x, int idim, int reduced,
+                               const double *h_inv, const double *boxlo)
+{
+  if (!reduced) return x[idim];
+  if (idim == 0)
+    return h_inv[0]*(x[0]-boxlo[0]) + h_inv[5]*(x[1]-boxlo[1]) +
+      h_inv[4]*(x[2]-boxlo[2]);
+  if (idim == 1)
+    return h_inv[1]*(x[1]-boxlo[1]) + h_inv[3]*(x[2]-boxlo[2]);
+  return h_inv[2]*(x[2]-boxlo[2]);
+}
+
+/* ----------------------------------------------------------------------
+   remap coordinate back into box via PBC if necessary and
+   return its bin index along one dimension
+------------------------------------------------------------------------- */
+
+static inline int coord2bin(double xremap, int periodic, double lo, double hi,
+                            double prd, double offset, double invdelta,
+                            int nlayerm1)
+{
+  if (periodic) {
+    if (xremap < lo) xremap += prd;
+    if (xremap >= hi) xremap -= prd;
+  }
+  int ibin = static_cast<int> ((xremap - offset) * invdelta);
+  ibin = MAX(ibin,0);
+  ibin = MIN(ibin,nlayerm1);
+  return ibin;
+}
+
 /* ----------------------------------------------------------------------
    assign each atom to a 1d bin
 ------------------------------------------------------------------------- */
@@ -997,8 +1531,6 @@ void FixAveSpatial::atom2bin1d()
 {
   int i,ibin;
   double *boxlo,*boxhi,*prd;
-  double xremap;
-  double lamda[3];
 
   double **x = atom->x;
   int *mask = atom->mask;
@@ -1008,55 +1540,32 @@ void FixAveSpatial::atom2bin1d()
   int nlayerm1 = nlayers[0] - 1;
   int periodicity = domain->periodicity[idim];
 
-  if (periodicity) {
-    if (scaleflag == REDUCED) {
-      boxlo = domain->boxlo_lamda;
-      boxhi = domain->boxhi_lamda;
-      prd = domain->prd_lamda;
-    } else {
-      boxlo = domain->boxlo;
-      boxhi = domain->boxhi;
-      prd = domain->prd;
-    }
+  int reduced = (scaleflag == REDUCED);
+  double *h_inv = domain->h_inv;
+  double *xlo = domain->boxlo;
+
+  if (reduced) {
+    boxlo = domain->boxlo_lamda;
+    boxhi = domain->boxhi_lamda;
+    prd = domain->prd_lamda;
+  } else {
+    boxlo = domain->boxlo;
+    boxhi = domain->boxhi;
+    prd = domain->prd;
   }
 
   // remap each atom's relevant coord back into box via PBC if necessary
   // if scaleflag = REDUCED, box coords -> lamda coords
 
-  if (regionflag == 0) {
-    if (scaleflag == REDUCED) domain->x2lamda(nlocal);
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit) {
-        xremap = x[i][idim];
-        if (periodicity) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        ibin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        ibin = MAX(ibin,0);
-        ibin = MIN(ibin,nlayerm1);
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
-    if (scaleflag == REDUCED) domain->lamda2x(nlocal);
+  for (i = 0; i < nlocal; i++) {
+    if (!(mask[i] & groupbit)) continue;
+    if (regionflag && !region->match(x[i][0],x[i][1],x[i][2])) continue;
 
-  } else {
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit && region->match(x[i][0],x[i][1],x[i][2])) {
-        if (scaleflag == REDUCED) {
-          domain->x2lamda(x[i],lamda);
-          xremap = lamda[idim];
-        } else xremap = x[i][idim];
-        if (periodicity) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        ibin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        ibin = MAX(ibin,0);
-        ibin = MIN(ibin,nlayerm1);
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
+    ibin = coord2bin(bin_coord(x[i],idim,reduced,h_inv,xlo),periodicity,
+                     boxlo[idim],boxhi[idim],prd[idim],
+                     offset[0],invdelta[0],nlayerm1);
+    bin[i] = ibin;
+    count_one[ibin] += 1.0;
   }
 }
 
@@ -1068,8 +1577,6 @@ void FixAveSpatial::atom2bin2d()
 {
   int i,ibin,i1bin,i2bin;
   double *boxlo,*boxhi,*prd;
-  double xremap,yremap;
-  double lamda[3];
 
   double **x = atom->x;
   int *mask = atom->mask;
@@ -1081,81 +1588,37 @@ void FixAveSpatial::atom2bin2d()
   int nlayer2m1 = nlayers[1] - 1;
   int* periodicity = domain->periodicity;
 
-  if (periodicity[idim] || periodicity[jdim]) {
-    if (scaleflag == REDUCED) {
-      boxlo = domain->boxlo_lamda;
-      boxhi = domain->boxhi_lamda;
-      prd = domain->prd_lamda;
-    } else {
-      boxlo = domain->boxlo;
-      boxhi = domain->boxhi;
-      prd = domain->prd;
-    }
+  int reduced = (scaleflag == REDUCED);
+  double *h_inv = domain->h_inv;
+  double *xlo = domain->boxlo;
+
+  if (reduced) {
+    boxlo = domain->boxlo_lamda;
+    boxhi = domain->boxhi_lamda;
+    prd = domain->prd_lamda;
+  } else {
+    boxlo = domain->boxlo;
+    boxhi = domain->boxhi;
+    prd = domain->prd;
   }
 
   // remap each atom's relevant coord back into box via PBC if necessary
   // if scaleflag = REDUCED, box coords -> lamda coords
 
-  if (regionflag == 0) {
-    if (scaleflag == REDUCED) domain->x2lamda(nlocal);
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit) {
-        xremap = x[i][idim];
-        if (periodicity[idim]) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        i1bin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        i1bin = MAX(i1bin,0);
-        i1bin = MIN(i1bin,nlayer1m1);
-
-        yremap = x[i][jdim];
-        if (periodicity[jdim]) {
-          if (yremap < boxlo[jdim]) yremap += prd[jdim];
-          if (yremap >= boxhi[jdim]) yremap -= prd[jdim];
-        }
-        i2bin = static_cast<int> ((yremap - offset[1]) * invdelta[1]);
-        i2bin = MAX(i2bin,0);
-        i2bin = MIN(i2bin,nlayer2m1);
+  for (i = 0; i < nlocal; i++) {
+    if (!(mask[i] & groupbit)) continue;
+    if (regionflag && !region->match(x[i][0],x[i][1],x[i][2])) continue;
 
-        ibin = i1bin*nlayers[1] + i2bin;
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
-    if (scaleflag == REDUCED) domain->lamda2x(nlocal);
+    i1bin = coord2bin(bin_coord(x[i],idim,reduced,h_inv,xlo),
+                      periodicity[idim],boxlo[idim],boxhi[idim],prd[idim],
+                      offset[0],invdelta[0],nlayer1m1);
+    i2bin = coord2bin(bin_coord(x[i],jdim,reduced,h_inv,xlo),
+                      periodicity[jdim],boxlo[jdim],boxhi[jdim],prd[jdim],
+                      offset[1],invdelta[1],nlayer2m1);
 
-  } else {
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit && region->match(x[i][0],x[i][1],x[i][2])) {
-        if (scaleflag == REDUCED) {
-          domain->x2lamda(x[i],lamda);
-          xremap = lamda[idim];
-          yremap = lamda[jdim];
-        } else {
-          xremap = x[i][idim];
-          yremap = x[i][jdim];
-        }
-
-        if (periodicity[idim]) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        i1bin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        i1bin = MAX(i1bin,0);
-        i1bin = MIN(i1bin,nlayer1m1-1);
-
-        if (periodicity[jdim]) {
-          if (yremap < boxlo[jdim]) yremap += prd[jdim];
-          if (yremap >= boxhi[jdim]) yremap -= prd[jdim];
-        }
-        i2bin = static_cast<int> ((yremap - offset[1]) * invdelta[1]);
-        i2bin = MAX(i2bin,0);
-        i2bin = MIN(i2bin,nlayer2m1-1);
-
-        ibin = i1bin*nlayers[1] + i2bin;
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
+    ibin = i1bin*nlayers[1] + i2bin;
+    bin[i] = ibin;
+    count_one[ibin] += 1.0;
   }
 }
 
@@ -1167,8 +1630,6 @@ void FixAveSpatial::atom2bin3d()
 {
   int i,ibin,i1bin,i2bin,i3bin;
   double *boxlo,*boxhi,*prd;
-  double xremap,yremap,zremap;
-  double lamda[3];
 
   double **x = atom->x;
   int *mask = atom->mask;
@@ -1182,100 +1643,40 @@ void FixAveSpatial::atom2bin3d()
   int nlayer3m1 = nlayers[2] - 1;
   int* periodicity = domain->periodicity;
 
-  if (periodicity[idim] || periodicity[jdim] || periodicity[kdim]) {
-    if (scaleflag == REDUCED) {
-      boxlo = domain->boxlo_lamda;
-      boxhi = domain->boxhi_lamda;
-      prd = domain->prd_lamda;
-    } else {
-      boxlo = domain->boxlo;
-      boxhi = domain->boxhi;
-      prd = domain->prd;
-    }
+  int reduced = (scaleflag == REDUCED);
+  double *h_inv = domain->h_inv;
+  double *xlo = domain->boxlo;
+
+  if (reduced) {
+    boxlo = domain->boxlo_lamda;
+    boxhi = domain->boxhi_lamda;
+    prd = domain->prd_lamda;
+  } else {
+    boxlo = domain->boxlo;
+    boxhi = domain->boxhi;
+    prd = domain->prd;
   }
 
   // remap each atom's relevant coord back into box via PBC if necessary
   // if scaleflag = REDUCED, box coords -> lamda coords
 
-  if (regionflag == 0) {
-    if (scaleflag == REDUCED) domain->x2lamda(nlocal);
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit) {
-        xremap = x[i][idim];
-        if (periodicity[idim]) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        i1bin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        i1bin = MAX(i1bin,0);
-        i1bin = MIN(i1bin,nlayer1m1);
-
-        yremap = x[i][jdim];
-        if (periodicity[jdim]) {
-          if (yremap < boxlo[jdim]) yremap += prd[jdim];
-          if (yremap >= boxhi[jdim]) yremap -= prd[jdim];
-        }
-        i2bin = static_cast<int> ((yremap - offset[1]) * invdelta[1]);
-        i2bin = MAX(i2bin,0);
-        i2bin = MIN(i2bin,nlayer2m1);
-
-        zremap = x[i][kdim];
-        if (periodicity[kdim]) {
-          if (zremap < boxlo[kdim]) yremap += prd[kdim];
-          if (zremap >= boxhi[kdim]) yremap -= prd[kdim];
-        }
-        i3bin = static_cast<int> ((zremap - offset[2]) * invdelta[2]);
-        i3bin = MAX(i3bin,0);
-        i3bin = MIN(i3bin,nlayer3m1);
-
-        ibin = i1bin*nlayers[1]*nlayers[2] + i2bin*nlayers[2] + i3bin;
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
-    if (scaleflag == REDUCED) domain->lamda2x(nlocal);
-
-  } else {
-    for (i = 0; i < nlocal; i++)
-      if (mask[i] & groupbit && region->match(x[i][0],x[i][1],x[i][2])) {
-        if (scaleflag == REDUCED) {
-          domain->x2lamda(x[i],lamda);
-          xremap = lamda[idim];
-          yremap = lamda[jdim];
-          zremap = lamda[kdim];
-        } else {
-          xremap = x[i][idim];
-          yremap = x[i][jdim];
-          zremap = x[i][kdim];
-        }
-
-        if (periodicity[idim]) {
-          if (xremap < boxlo[idim]) xremap += prd[idim];
-          if (xremap >= boxhi[idim]) xremap -= prd[idim];
-        }
-        i1bin = static_cast<int> ((xremap - offset[0]) * invdelta[0]);
-        i1bin = MAX(i1bin,0);
-        i1bin = MIN(i1bin,nlayer1m1);
-
-        if (periodicity[jdim]) {
-          if (yremap < boxlo[jdim]) yremap += prd[jdim];
-          if (yremap >= boxhi[jdim]) yremap -= prd[jdim];
-        }
-        i2bin = static_cast<int> ((yremap - offset[1]) * invdelta[1]);
-        i2bin = MAX(i2bin,0);
-        i2bin = MIN(i2bin,nlayer2m1);
-
-        if (periodicity[kdim]) {
-          if (zremap < boxlo[kdim]) yremap += prd[kdim];
-          if (zremap >= boxhi[kdim]) yremap -= prd[kdim];
-        }
-        i3bin = static_cast<int> ((zremap - offset[2]) * invdelta[2]);
-        i3bin = MAX(i3bin,0);
-        i3bin = MIN(i3bin,nlayer3m1);
-
-        ibin = i1bin*nlayers[1]*nlayers[2] + i2bin*nlayers[2] + i3bin;
-        bin[i] = ibin;
-        count_one[ibin] += 1.0;
-      }
+  for (i = 0; i < nlocal; i++) {
+    if (!(mask[i] & groupbit)) continue;
+    if (regionflag && !region->match(x[i][0],x[i][1],x[i][2])) continue;
+
+    i1bin = coord2bin(bin_coord(x[i],idim,reduced,h_inv,xlo),
+                      periodicity[idim],boxlo[idim],boxhi[idim],prd[idim],
+                      offset[0],invdelta[0],nlayer1m1);
+    i2bin = coord2bin(bin_coord(x[i],jdim,reduced,h_inv,xlo),
+                      periodicity[jdim],boxlo[jdim],boxhi[jdim],prd[jdim],
+                      offset[1],invdelta[1],nlayer2m1);
+    i3bin = coord2bin(bin_coord(x[i],kdim,reduced,h_inv,xlo),
+                      periodicity[kdim],boxlo[kdim],boxhi[kdim],prd[kdim],
+                      offset[2],invdelta[2],nlayer3m1);
+
+    ibin = i1bin*nlayers[1]*nlayers[2] + i2bin*nlayers[2] + i3bin;
+    bin[i] = ibin;
+    count_one[ibin] += 1.0;
   }
 }
 
@@ -1296,6 +1697,99 @@ double FixAveSpatial::compute_array(int i, int j)
   return values_total[i][j]/norm;
 }
 
+/* ----------------------------------------------------------------------
+   multilinear interpolation of averaged values between bin centers at point x
+   periodic dims wrap around only if bins tile the box exactly
+     (offset = boxlo and nlayers*delta = prd), then the wrapped neighbor
+     bin center is one delta away across the boundary,
+   other dims are constant beyond outer bin centers
+   empty bins are skipped for per-atom averages and weights of the other
+     corners are renormalized, densities of empty bins are 0 and are kept
+   return 0 if there are no averaged values yet or all corner bins are empty
+------------------------------------------------------------------------- */
+
+int FixAveSpatial::interpolate(double *x, double *result)
+{
+  int m,j,corner;
+
+  if (values_total == NULL || norm == 0) return 0;
+
+  int reduced = (scaleflag == REDUCED);
+  double *boxlo,*boxhi,*prd;
+  if (reduced) {
+    boxlo = domain->boxlo_lamda;
+    boxhi = domain->boxhi_lamda;
+    prd = domain->prd_lamda;
+  } else {
+    boxlo = domain->boxlo;
+    boxhi = domain->boxhi;
+    prd = domain->prd;
+  }
+
+  // lower and upper bin and weight of the upper bin in every dim
+
+  int ilo[3],ihi[3];
+  double frac[3];
+  for (m = 0; m < ndim; m++) {
+    int idim = dim[m];
+    double xm = bin_coord(x,idim,reduced,domain->h_inv,domain->boxlo);
+    int periodic = domain->periodicity[idim];
+    double tol = 1.0e-6*delta[m];
+    int wrap = periodic && fabs(offset[m] - boxlo[idim]) <= tol &&
+      fabs(nlayers[m]*delta[m] - prd[idim]) <= tol;
+    if (periodic) {
+      if (xm < boxlo[idim]) xm += prd[idim];
+      if (xm >= boxhi[idim]) xm -= prd[idim];
+    }
+    double s = (xm - offset[m])*invdelta[m] - 0.5;
+    int i = static_cast<int> (floor(s));
+    frac[m] = s - i;
+    ilo[m] = i;
+    ihi[m] = i+1;
+    if (wrap) {
+      ilo[m] = (ilo[m] + nlayers[m]) % nlayers[m];
+      ihi[m] = ihi[m] % nlayers[m];
+    } else if (ilo[m] < 0) {
+      ilo[m] = ihi[m] = 0;
+      frac[m] = 0.0;
+    } else if (ihi[m] > nlayers[m]-1) {
+      ilo[m] = ihi[m] = nlayers[m]-1;
+      frac[m] = 0.0;
+    }
+  }
+
+  for (j = 0; j < nvalues; j++) result[j] = 0.0;
+  double wsum = 0.0;
+  double wsum_density = 0.0;
+  for (corner = 0; corner < (1 << ndim); corner++) {
+    int ibin = 0;
+    double w = 1.0;
+    for (m = 0; m < ndim; m++) {
+      int upper = (corner >> m) & 1;
+      ibin = ibin*nlayers[m] + (upper ? ihi[m] : ilo[m]);
+      w *= upper ? frac[m] : 1.0 - frac[m];
+    }
+    if (w == 0.0) continue;
+    wsum_density += w;
+    if (count_total[ibin] == 0.0) {
+      for (j = 0; j < nvalues; j++)
+        if (which[j] == DENSITY_NUMBER || which[j] == DENSITY_MASS)
+          result[j] += w*values_total[ibin][j];
+      continue;
+    }
+    for (j = 0; j < nvalues; j++) result[j] += w*values_total[ibin][j];
+    wsum += w;
+  }
+  if (wsum == 0.0) return 0;
+
+  for (j = 0; j < nvalues; j++) {
+    if (which[j] == DENSITY_NUMBER || which[j] == DENSITY_MASS)
+      result[j] /= wsum_density*norm;
+    else result[j] /= wsum*norm;
+  }
+  return 1;
+}
+
 /* ----------------------------------------------------------------------
    calculate nvalid = next step on which end_of_step does something
    can be this timestep if multiple of nfreq and nrepeat = 1
@@ -1324,8 +1818,22 @@ double FixAveSpatial::memory_usage()
   bytes += 4*nbins * sizeof(double);              // count one,many,sum,total
   bytes += ndim*nbins * sizeof(double);           // coord
   bytes += nvalues*nbins * sizeof(double);        // values one,many,sum,total
-  bytes += nwindow*nbins * sizeof(double);          // count_list
-  bytes += nwindow*nbins*nvalues * sizeof(double);  // values_list
+  if (ave == WINDOW && me == 0) {
+    int nsize = wfloat ? sizeof(float) : sizeof(double);
+    bytes += nwindow*nbins * nsize;                   // count_list
+    bytes += nwindow*nbins*nvalues * nsize;           // values_list
+    bytes += nbins*(nvalues+1) * sizeof(double);      // count/values_comp
+  }
+  bytes += maxslab * sizeof(double);              // slab
+  if (ncorr) {
+    bytes += nbins*(ncorr+1) * sizeof(double);        // corr_one
+    if (me == 0) {
+      bytes += nbins*(ncorr+1) * sizeof(double);      // corr_all
+      bytes += nbins*ncorr * sizeof(double);          // corr_sample
+      bytes += (2.0*corr_nlevels*corr_p + corr_nlevels + 1) *
+        nbins*ncorr * sizeof(double);                 // correlator
+    }
+  }
   return bytes;
 }
 
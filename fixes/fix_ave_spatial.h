@@ -23,6 +23,8 @@ FixStyle(ave/spatial,FixAveSpatial)
 #include "stdio.h"
 #include "fix.h"
 
+class MultiTauCorrelator;
+
 namespace LAMMPS_NS {
 
 class FixAveSpatial : public Fix {
@@ -33,9 +35,12 @@ class FixAveSpatial : public Fix {
   void init();
   void setup(int);
   void end_of_step();
+  void post_run();
   double compute_array(int,int);
   double memory_usage();
   void reset_timestep(bigint);
+  int interpolate(double *, double *);
+  int get_nvalues() const { return nvalues; }
 
  private:
   int me,nvalues;
@@ -49,7 +54,7 @@ class FixAveSpatial : public Fix {
   class Region *region;
 
   int ave,nwindow,scaleflag;
-  int norm,iwindow,window_limit;
+  int norm,iwindow,window_limit,wfloat;
   double xscale,yscale,zscale;
   double bin_volume;
 
@@ -70,13 +75,43 @@ class FixAveSpatial : public Fix {
   double **values_one,**values_many,**values_sum;
   double *count_total,**count_list;
   double **values_total,***values_list;
+  float **count_flist,***values_flist;
+  double *count_comp,**values_comp;
 
   bool isTecFile;
 
+  int filterflag;
+  double filtercount;
+  char *idfilter;
+  class Region *filterregion;
+  bool isBinFile;
+  MPI_File mpifh;
+  FILE *fpindex;
+  long indexpos;
+  bigint nframes;
+  int binbins;
+  int maxslab;
+  double *slab;
+
+  int ncorr,*corrcol;
+  int corr_p,corr_m,corr_nlevels;
+  int corrfreq;
+  bigint corr_nsample;
+  FILE *fpcorr;
+  double *corr_one,*corr_all,*corr_sample;
+  MultiTauCorrelator *correlator;
+
   void setup_bins();
   void atom2bin1d();
   void atom2bin2d();
   void atom2bin3d();
+  void allocate_window();
+  void update_window();
+  void allocate_correlator();
+  void correlate_sample();
+  void write_correlation(bigint);
+  void write_binary(bigint);
+  int bin_selected(int);
   bigint nextvalid();
 };
 
@@ -110,6 +145,36 @@ E: Cannot open fix ave/spatial file %s
 The specified file cannot be opened.  Check that the path and name are
 correct.
 
+E: Cannot open fix ave/spatial binary file %s
+
+The specified file cannot be opened with MPI-IO.  Check that the path
+and name are correct.
+
+E: Fix ave/spatial binary file requires constant number of bins
+
+Frames of the binary file have a fixed size, use units reduced
+if the box changes.
+
+E: Fix ave/spatial filter region requires 3d bins
+
+The region filter is tested at bin centers, which are only defined
+for 3d binning.
+
+E: Cannot open fix ave/spatial correlate file %s
+
+The specified file cannot be opened.  Check that the path and name are
+correct.
+
+E: Fix ave/spatial correlate requires nevery*nrepeat = nfreq
+
+Samples fed to the multiple-tau correlator must be equally spaced
+in time.
+
+E: Fix ave/spatial corrfreq must be a multiple of nfreq
+
+The correlate file is written at the end of the run and, if corrfreq
+is not 0, on output steps which are multiples of corrfreq.
+
 E: Compute ID for fix ave/spatial does not exist
 
 Self-explanatory.
@@ -168,9 +233,9 @@ A lattice must be defined to use fix ave/spatial with units = lattice.
 
 E: Fix ave/spatial settings invalid with changing box
 
-If the ave setting is "running" or "window" and the box size/shape
-changes during the simulation, then the units setting must be
-"reduced", else the number of bins may change.
+If the ave setting is "running" or "window" or correlate is used and
+the box size/shape changes during the simulation, then the units
+setting must be "reduced", else the number of bins may change.
 
 E: Fix for fix ave/spatial not computed at compatible time
 
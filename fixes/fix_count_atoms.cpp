@@ -16,12 +16,20 @@
 #include "update.h"
 #include "group.h"
 #include "math_extra.h"
+#include "../utils/region_communicator.h"
+#include "../utils/lazy_reduction.h"
 
 using namespace LAMMPS_NS;
 
+namespace
+{
+  // count vx vy vz
+  const int nreduced = 4;
+}
+
 FixCountAtoms::FixCountAtoms(LAMMPS *lmp, int narg, char **arg) :
   Fix(lmp, narg, arg), m_countOfMesurments(0), m_region(0),
-  m_isActive(false), m_atomsCount(0), m_comm(MPI_COMM_NULL),
+  m_regionComm(0), m_reduction(0), m_atomsCount(0),
   m_root(0), m_firstTimeStep(0)
 {
   if (narg < 6) error->all(FLERR,"Illegal fix wall/bb command");
@@ -30,6 +38,9 @@ FixCountAtoms::FixCountAtoms(LAMMPS *lmp, int narg, char **arg) :
   if (iregion == -1) error->all(FLERR,"Region ID does not exist");
 
   m_region = domain->regions[iregion];
+  m_regionComm = new RegionCommunicator(lmp);
+  m_regionComm->setRegion(m_region);
+  m_reduction = new LazyReduction(nreduced);
 
   nevery = force->inumeric(arg[4]);
   m_countOfMesurments = force->inumeric(arg[5]);
@@ -49,6 +60,8 @@ FixCountAtoms::FixCountAtoms(LAMMPS *lmp, int narg, char **arg) :
 
 FixCountAtoms::~FixCountAtoms()
 {
+  delete m_reduction;
+  delete m_regionComm;
 }
 
 int FixCountAtoms::setmask()
@@ -64,78 +77,61 @@ void FixCountAtoms::setup(int)
   m_firstTimeStep = update->ntimestep;
 
   // if subdomain doesn't intersect bounding box for the region
-  // there is no need to run end_of_step. I check it using monte-carlo approach
-  // due to it seems to be natural in lammps
-
-  igroup = group->find("all");
-  if (igroup == -1) error->all(FLERR,"Could not find fix group ID \"all\"");
-  int all_groupbit = group->bitmask[igroup];
-
-  double** x = atom->x;
-
-  int *mask = atom->mask;
-  int nlocal = atom->nlocal;
-
-  for (int i = 0; i < nlocal; i++) {
-    if (mask[i] & all_groupbit) {
-      if (m_region->match(x[i][0], x[i][1], x[i][2])) {
-        m_isActive = true;
-        break;
-      }
-    }
-  }
-  m_comm = createCommunicator();
-  assert(m_isActive ? (m_comm != MPI_COMM_NULL) : (m_comm == MPI_COMM_NULL));
+  // there is no need to run end_of_step
+  m_regionComm->setRegion(m_region);
+  updateCommunicator();
 }
 
 void FixCountAtoms::end_of_step()
 {
-  if (!m_isActive)
+  updateCommunicator();
+  if (!m_regionComm->isActive())
     return;
+  MPI_Comm regionComm = m_regionComm->getComm();
 
-  int countLocal = 0;
   double** x = atom->x;
 
   int *mask = atom->mask;
   int nlocal = atom->nlocal;
 
-  double localAvgVel[3];
-  memset(localAvgVel, 0, 3 * sizeof(localAvgVel[0]));
+  // count and sum of velocities are reduced together
+  double local[nreduced];
+  memset(local, 0, nreduced * sizeof(local[0]));
 
   for (int i = 0; i < nlocal; i++) {
     if (mask[i] & groupbit) {
       if (m_region->match(x[i][0], x[i][1], x[i][2])) {
-        MathExtra::add3(localAvgVel, atom->v[i], localAvgVel);
-        ++countLocal;
+        MathExtra::add3(local + 1, atom->v[i], local + 1);
+        local[0] += 1.0;
       }
     }
   }
 
-  int globalCount = 0;
-  assert(m_comm != MPI_COMM_NULL);
-  MPI_Reduce(&countLocal, &globalCount, 1, MPI_INT, MPI_SUM, m_root, m_comm);
+  // values are needed only at the output step, so the reduction is not waited for
+  assert(regionComm != MPI_COMM_NULL);
+  if (m_reduction->isFull())
+    completeReductions();
+  m_reduction->reduce(local, m_root, regionComm);
 
-  double globalAvgVel[3];
-  memset(globalAvgVel, 0, 3 * sizeof(globalAvgVel[0]));
-  MPI_Reduce(&localAvgVel, &globalAvgVel, 3, MPI_DOUBLE, MPI_SUM, m_root, m_comm);
-
-  MathExtra::scale3(1.0 / globalCount, globalAvgVel);
-  MathExtra::add3(m_avgVel, globalAvgVel, m_avgVel);
-
-  int rankInGroup;
-  MPI_Comm_rank(m_comm, &rankInGroup);
+  if (update->ntimestep - m_firstTimeStep != nevery * m_countOfMesurments) {
+    m_reduction->progress();
+    return;
+  }
 
-  if (rankInGroup == m_root) {
-    m_atomsCount += globalCount;
-    if (update->ntimestep - m_firstTimeStep == nevery * m_countOfMesurments) {
-      //time-averaging
-      m_atomsCount /= m_countOfMesurments;
-      MathExtra::scale3(1.0 / static_cast<double>(m_countOfMesurments), m_avgVel);
-      writeResult();
-    }
+  completeReductions();
+  if (isRoot()) {
+    //time-averaging
+    m_atomsCount /= m_countOfMesurments;
+    MathExtra::scale3(1.0 / static_cast<double>(m_countOfMesurments), m_avgVel);
+    writeResult();
   }
 }
 
+void FixCountAtoms::post_run()
+{
+  completeReductions();
+}
+
 void FixCountAtoms::writeResult()
 {
   std::fstream file(m_fileName.c_str(), std::fstream::app|std::fstream::out);
@@ -151,10 +147,56 @@ void FixCountAtoms::writeResult()
   file.close();
 }
 
-MPI_Comm FixCountAtoms::createCommunicator()
+bool FixCountAtoms::isRoot() const
+{
+  if (!m_regionComm->isActive())
+    return false;
+  int rankInGroup;
+  MPI_Comm_rank(m_regionComm->getComm(), &rankInGroup);
+  return rankInGroup == m_root;
+}
+
+void FixCountAtoms::updateCommunicator()
+{
+  // active procs are changed only when the decomposition changes,
+  // pending reductions are completed on the old communicator
+  if (!m_regionComm->evaluate())
+    return;
+  completeReductions();
+  bool wasRoot = isRoot();
+  m_regionComm->rebuild();
+  moveAccumulatedValues(wasRoot);
+}
+
+void FixCountAtoms::completeReductions()
+{
+  // results are given only on the root
+  std::vector<double> results;
+  int nresults = m_reduction->complete(results);
+  for (int k = 0; k < nresults; ++k) {
+    double* global = &results[nreduced * k];
+    int globalCount = static_cast<int>(global[0]);
+    if (globalCount != 0) {
+      MathExtra::scale3(1.0 / globalCount, global + 1);
+      MathExtra::add3(m_avgVel, global + 1, m_avgVel);
+    }
+    m_atomsCount += globalCount;
+  }
+}
+
+void FixCountAtoms::moveAccumulatedValues(bool wasRoot)
 {
-  //in sake of communication performance create communicator for active procs
-  MPI_Comm communicator = MPI_COMM_NULL;
-  MPI_Comm_split(world, m_isActive ? 0 : MPI_UNDEFINED , comm->me, &communicator);
-  return communicator;
+  // values are accumulated on the root of the old communicator, it gives them to the new root
+  double local[nreduced] = {static_cast<double>(m_atomsCount), m_avgVel[0], m_avgVel[1], m_avgVel[2]};
+  if (!wasRoot)
+    memset(local, 0, nreduced * sizeof(local[0]));
+  double global[nreduced];
+  MPI_Allreduce(local, global, nreduced, MPI_DOUBLE, MPI_SUM, world);
+
+  if (!isRoot())
+    memset(global, 0, nreduced * sizeof(global[0]));
+  m_atomsCount = static_cast<int>(global[0]);
+  m_avgVel[0] = global[1];
+  m_avgVel[1] = global[2];
+  m_avgVel[2] = global[3];
 }
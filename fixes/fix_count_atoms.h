@@ -14,15 +14,17 @@ FixStyle(count/atoms,FixCountAtoms)
 #include "fix.h"
 #include <string>
 
+class LazyReduction;
+
 namespace LAMMPS_NS {
 
 class FixCountAtoms : public Fix {
   int m_countOfMesurments;
   class Region* m_region;
-  bool m_isActive; //if the subdomain of the current proc doesn't contain region, don't do any computations
+  class RegionCommunicator* m_regionComm; //if the subdomain of the current proc doesn't overlap region, don't do any computations
+  LazyReduction* m_reduction; // per step reductions completed at the output step
   std::string m_fileName;
   int m_atomsCount; // atoms for m_countOfMesurments
-  MPI_Comm m_comm;
   int m_root;
   double m_velDir[3];
   double m_avgVel[3];
@@ -33,9 +35,13 @@ class FixCountAtoms : public Fix {
   int setmask();
   void setup(int);
   void end_of_step();
+  void post_run();
  protected:
   virtual void writeResult();
-  MPI_Comm createCommunicator();
+  bool isRoot() const;
+  void moveAccumulatedValues(bool wasRoot);
+  void updateCommunicator();
+  void completeReductions();
 };
 
 }
@@ -0,0 +1,242 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "string.h"
+#include "fix_count_regions.h"
+#include "atom.h"
+#include "comm.h"
+#include "domain.h"
+#include "error.h"
+#include "force.h"
+#include "neighbor.h"
+#include "region.h"
+#include "update.h"
+#include <algorithm>
+
+using namespace LAMMPS_NS;
+
+namespace
+{
+  const int nvalues = 4; // count vx vy vz
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixCountRegions::FixCountRegions(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), m_lastIndexBuild(-1), m_nrepeat(0), m_nsamples(0)
+{
+  if (narg < 6) error->all(FLERR,"Illegal fix count/regions command");
+
+  nevery = force->inumeric(arg[3]);
+  m_nrepeat = force->inumeric(arg[4]);
+  if (nevery <= 0 || m_nrepeat <= 0)
+    error->all(FLERR,"Illegal fix count/regions command: N and Nrepeat must be positive integers");
+
+  std::string fileName;
+  for (int iarg = 5; iarg < narg; ++iarg) {
+    if (strcmp(arg[iarg], "file") == 0) {
+      if (iarg + 2 != narg) error->all(FLERR,"Illegal fix count/regions command: file must be the last keyword");
+      fileName = arg[iarg + 1];
+      break;
+    }
+    if (domain->find_region(arg[iarg]) == -1)
+      error->all(FLERR,"Region ID for fix count/regions does not exist");
+    m_regionIds.push_back(arg[iarg]);
+  }
+  if (m_regionIds.empty()) error->all(FLERR,"Illegal fix count/regions command: no regions");
+
+  int nregions = static_cast<int>(m_regionIds.size());
+  m_local.assign(nvalues * nregions, 0.0);
+  m_sum.assign(nvalues * nregions, 0.0);
+  m_array.assign(nvalues * nregions, 0.0);
+
+  array_flag = 1;
+  size_array_rows = nregions;
+  size_array_cols = nvalues;
+  global_freq = nevery * m_nrepeat;
+  extarray = 0;
+
+  if (comm->me == 0 && !fileName.empty()) {
+    m_file.open(fileName.c_str());
+    if (!m_file.is_open())
+      error->one(FLERR,"Cannot open fix count/regions file");
+    m_file << "# Fix count/regions " << id << ": mean count and velocity per region" << std::endl
+           << "# Timestep Number-of-regions" << std::endl
+           << "# Region count vx vy vz" << std::endl;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixCountRegions::setmask()
+{
+  int mask = 0;
+  mask |= FixConst::END_OF_STEP;
+  return mask;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixCountRegions::init()
+{
+  m_regions.resize(m_regionIds.size());
+  for (size_t r = 0; r < m_regionIds.size(); ++r) {
+    int iregion = domain->find_region(const_cast<char*>(m_regionIds[r].c_str()));
+    if (iregion == -1) error->all(FLERR,"Region ID for fix count/regions does not exist");
+    m_regions[r] = domain->regions[iregion];
+  }
+  m_lastIndexBuild = -1;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixCountRegions::setup(int)
+{
+  buildIndex();
+}
+
+/* ----------------------------------------------------------------------
+   every local atom of the group is tested against candidates of its cell,
+   counts and sums of all regions are reduced together
+------------------------------------------------------------------------- */
+
+void FixCountRegions::end_of_step()
+{
+  // local atoms stay within the subdomain extended by the skin until reneighboring
+  if (m_lastIndexBuild != neighbor->lastcall)
+    buildIndex();
+
+  std::fill(m_local.begin(), m_local.end(), 0.0);
+  double** x = atom->x;
+  int* mask = atom->mask;
+  int nlocal = atom->nlocal;
+
+  for (int i = 0; i < nlocal; ++i) {
+    if (!(mask[i] & groupbit))
+      continue;
+    for (size_t k = 0; k < m_unindexed.size(); ++k)
+      addAtom(m_unindexed[k], i);
+
+    const int *begin, *end;
+    if (m_index.getCandidates(x[i], begin, end)) {
+      for (const int* r = begin; r != end; ++r)
+        addAtom(*r, i);
+    } else {
+      // atom has left the extended subdomain, can happen only with very fast atoms
+      for (size_t k = 0; k < m_indexed.size(); ++k)
+        addAtom(m_indexed[k], i);
+    }
+  }
+
+  std::vector<double> global(m_local.size(), 0.0);
+  MPI_Allreduce(&m_local[0], &global[0], static_cast<int>(m_local.size()), MPI_DOUBLE, MPI_SUM, world);
+  for (size_t k = 0; k < global.size(); ++k)
+    m_sum[k] += global[k];
+  ++m_nsamples;
+
+  if (update->ntimestep % global_freq == 0) {
+    for (size_t r = 0; r < m_regions.size(); ++r) {
+      double* sum = &m_sum[nvalues * r];
+      double* result = &m_array[nvalues * r];
+      result[0] = sum[0] / m_nsamples;
+      for (int d = 1; d < nvalues; ++d)
+        result[d] = sum[0] > 0.0 ? sum[d] / sum[0] : 0.0;
+    }
+    if (m_file.is_open())
+      writeResult();
+    std::fill(m_sum.begin(), m_sum.end(), 0.0);
+    m_nsamples = 0;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixCountRegions::compute_array(int i, int j)
+{
+  return m_array[nvalues * i + j];
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixCountRegions::memory_usage()
+{
+  return (m_local.size() + m_sum.size() + m_array.size()) * sizeof(double) +
+      (m_indexed.size() + m_unindexed.size() + m_index.getNumCells() + m_regions.size()) * sizeof(int);
+}
+
+/* ----------------------------------------------------------------------
+   grid covers the subdomain extended by the skin, it is rebuilt after
+   reneighboring because subdomains change with load balancing and box changes
+------------------------------------------------------------------------- */
+
+void FixCountRegions::buildIndex()
+{
+  m_lastIndexBuild = neighbor->lastcall;
+
+  m_indexed.clear();
+  m_unindexed.clear();
+  std::vector<BoundingBox> boxes(m_regions.size());
+  for (size_t r = 0; r < m_regions.size(); ++r) {
+    Region* region = m_regions[r];
+    BoundingBox& box = boxes[r];
+    if (!region->bboxflag || region->dynamic || region->varshape || !region->interior) {
+      m_unindexed.push_back(static_cast<int>(r));
+      // empty box is not listed in the grid
+      for (int d = 0; d < 3; ++d) {
+        box.lo[d] = 1.0;
+        box.hi[d] = -1.0;
+      }
+      continue;
+    }
+    m_indexed.push_back(static_cast<int>(r));
+    box.lo[0] = region->extent_xlo;
+    box.hi[0] = region->extent_xhi;
+    box.lo[1] = region->extent_ylo;
+    box.hi[1] = region->extent_yhi;
+    box.lo[2] = region->extent_zlo;
+    box.hi[2] = region->extent_zhi;
+  }
+
+  double lo[3], hi[3];
+  if (domain->triclinic) {
+    domain->bbox(domain->sublo_lamda, domain->subhi_lamda, lo, hi);
+  } else {
+    for (int d = 0; d < 3; ++d) {
+      lo[d] = domain->sublo[d];
+      hi[d] = domain->subhi[d];
+    }
+  }
+  for (int d = 0; d < 3; ++d) {
+    lo[d] -= neighbor->skin;
+    hi[d] += neighbor->skin;
+  }
+  m_index.build(boxes, lo, hi);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixCountRegions::addAtom(int region, int i)
+{
+  double* xi = atom->x[i];
+  if (!m_regions[region]->match(xi[0], xi[1], xi[2]))
+    return;
+  double* local = &m_local[nvalues * region];
+  local[0] += 1.0;
+  local[1] += atom->v[i][0];
+  local[2] += atom->v[i][1];
+  local[3] += atom->v[i][2];
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixCountRegions::writeResult()
+{
+  m_file << update->ntimestep << " " << m_regions.size() << std::endl;
+  for (size_t r = 0; r < m_regions.size(); ++r) {
+    const double* result = &m_array[nvalues * r];
+    m_file << m_regionIds[r] << " " << result[0] << " " << result[1] << " "
+        << result[2] << " " << result[3] << std::endl;
+  }
+  m_file.flush();
+}
@@ -0,0 +1,61 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifdef FIX_CLASS
+
+FixStyle(count/regions,FixCountRegions)
+
+#else
+
+#ifndef LMP_FIX_COUNT_REGIONS_H
+#define LMP_FIX_COUNT_REGIONS_H
+
+#include "fix.h"
+#include "../utils/box_grid_index.h"
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace LAMMPS_NS {
+
+/**
+* @class
+*   Counts atoms of the group and averages their velocity in many regions (probes) in one pass.
+*   fix ID group count/regions N Nrepeat regionID1 regionID2 ... [file name]
+*   Every N steps each local atom is tested only against regions whose extents overlap its cell
+*   of a uniform grid built over the subdomain, regions without extent, dynamic and outside regions
+*   are tested for every atom. Counts and velocity sums of all regions are reduced by one collective.
+*   Every N*Nrepeat steps the mean count per sample and the mean velocity of counted atoms are
+*   stored in a global array with a row per region (count vx vy vz) and written to the file.
+*/
+class FixCountRegions : public Fix
+{
+  std::vector<std::string> m_regionIds;
+  std::vector<class Region*> m_regions;
+  std::vector<int> m_unindexed; // regions tested for every atom
+  std::vector<int> m_indexed;
+  BoxGridIndex m_index;
+  bigint m_lastIndexBuild; // neighbor->lastcall when index was built, -1 to force it
+  int m_nrepeat, m_nsamples;
+  std::vector<double> m_local, m_sum; // count vx vy vz per region
+  std::vector<double> m_array;
+  std::ofstream m_file; // only on root
+public:
+  FixCountRegions(class LAMMPS *, int, char **);
+  int setmask();
+  void init();
+  void setup(int);
+  void end_of_step();
+  double compute_array(int, int);
+  double memory_usage();
+private:
+  void buildIndex();
+  void addAtom(int region, int i);
+  void writeResult();
+};
+
+}
+
+#endif
+#endif
@@ -2,63 +2,357 @@
 //
 // Distributed under the GNU Software License (See accompanying file LICENSE)
 
+#include "stdlib.h"
+#include "string.h"
 #include "fix_dump_mesh.h"
 #include "update.h"
 #include "input.h"
 #include "modify.h"
 #include "variable.h"
+#include "compute.h"
 #include "error.h"
+#include "memory.h"
 #include "math_extra.h"
 #include "../utils/gather_containers.h"
+#include "../utils/mesh_writer.h"
+#include "../utils/parallel_mesh_trajectory.h"
+#include "../utils/async_mesh_writer.h"
+#include "../utils/molecule_counter.h"
 #include "atom.h"
+#include "domain.h"
 #include "neighbor.h"
 #include "comm.h"
 #include <fstream>
 #include <iostream>
 #include <ios>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <limits>
+#include <sstream>
+#include <set>
 
 using namespace LAMMPS_NS;
 
+#define INVOKED_PERATOM 8
+
 namespace {
-  // aux structure used for ease sorting of linearized array of points
-  struct Point {
-    float tag, x, y, z;
-  };
-  bool operator< (Point i, Point j) { return (i.tag < j.tag); }
+  // vertex record is [tag, m_nfields floats], tag is kept as integer so it is exact
+  inline tagint& recordTag(char* record)
+  {
+    return *reinterpret_cast<tagint*>(record);
+  }
 
+  inline float* recordValues(char* record)
+  {
+    return reinterpret_cast<float*>(record + sizeof(tagint));
+  }
 
-  // helper for unordered_map object put/get
-  void put(int tag, int vertInd, std::unordered_map<int, int>& map)
+  // 64 bit finalizer of splitmix, hashes are summed so checksums do not depend on atoms order
+  inline unsigned long long mix(unsigned long long h)
   {
-    map.insert(std::make_pair(tag, vertInd));
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
   }
 
-  int get(const std::unordered_map<int, int>& map, int tag)
+  int get(const std::vector<int>& tags2VertInd, tagint minTag, tagint tag)
   {
-    std::unordered_map<int, int>::const_iterator got = map.find(tag);
-    if (got == map.end())
+    tagint i = tag - minTag;
+    if (i < 0 || i >= static_cast<tagint>(tags2VertInd.size()) || tags2VertInd[i] < 0)
       throw "tags mapping is invalid";
-    return got->second;
+    return tags2VertInd[i];
   }
 }
 
 /* ---------------------------------------------------------------------- */
 
 FixDumpMesh::FixDumpMesh(LAMMPS *lmp, int narg, char **arg) :
-  Fix(lmp, narg, arg), m_nglobalParticles(0), m_maxArea(2.0)
+  Fix(lmp, narg, arg), m_nglobalParticles(0), m_minTag(0),
+  m_nfields(3), m_recordSize(0), m_recordType(MPI_DATATYPE_NULL),
+  m_format("obj"), m_writer(0), m_framesInFlight(0), m_asyncWriter(0),
+  m_parallelWriter(0), m_firstVertex(0), m_moleculeUnwrap(false), m_moleculeCounter(0), m_globalMinTag(0),
+  m_triggerDistance(0.0), m_minInterval(0), m_maxInterval(0), m_lastDumpStep(-1), m_xref(0),
+  m_partitionWriters(0), m_dumpEvery(0), m_previewEvery(0), m_previewRings(0), m_previewWriter(0)
 {
+  std::fill(m_checksums, m_checksums + NCHECKSUMS, 0ULL);
   if (narg < 5) error->all(FLERR,"Illegal fix print command");
 
   nevery = atoi(arg[3]);
   if (nevery <= 0) error->all(FLERR,"Illegal fix dump mesh command: nevery must be positive integer");
+  m_dumpEvery = nevery;
 
   m_fileNameTemplate = std::string(arg[4]);
+
+  // per-atom attributes precede keywords
+  int iarg = 5;
+  while (iarg < narg) {
+    int kind;
+    if (strcmp(arg[iarg], "vx") == 0) kind = VX;
+    else if (strcmp(arg[iarg], "vy") == 0) kind = VY;
+    else if (strcmp(arg[iarg], "vz") == 0) kind = VZ;
+    else if (strcmp(arg[iarg], "fx") == 0) kind = FX;
+    else if (strcmp(arg[iarg], "fy") == 0) kind = FY;
+    else if (strcmp(arg[iarg], "fz") == 0) kind = FZ;
+    else if (strncmp(arg[iarg], "c_", 2) == 0) kind = COMPUTE;
+    else if (strncmp(arg[iarg], "f_", 2) == 0) kind = FIX;
+    else if (strncmp(arg[iarg], "v_", 2) == 0) kind = VARIABLE;
+    else break;
+
+    int column = 0;
+    std::string id;
+    if (kind == COMPUTE || kind == FIX || kind == VARIABLE) {
+      id = std::string(arg[iarg] + 2);
+      size_t bracket = id.find('[');
+      if (bracket != std::string::npos) {
+        if (id[id.size() - 1] != ']' || kind == VARIABLE)
+          error->all(FLERR,"Illegal fix dump mesh command");
+        column = atoi(id.c_str() + bracket + 1);
+        if (column <= 0) error->all(FLERR,"Illegal fix dump mesh command");
+        id.erase(bracket);
+      }
+    }
+    m_attributeKinds.push_back(kind);
+    m_attributeColumns.push_back(column);
+    m_attributeIds.push_back(id);
+    m_attributeNames.push_back(std::string(arg[iarg]));
+    ++iarg;
+  }
+  m_nfields = 3 + m_attributeKinds.size();
+  m_attributeIndices.resize(m_attributeKinds.size(), -1);
+  m_variableValues.resize(m_attributeKinds.size());
+
+  for (size_t m = 0; m < m_attributeKinds.size(); ++m) {
+    char* id = const_cast<char*>(m_attributeIds[m].c_str());
+    int column = m_attributeColumns[m];
+    if (m_attributeKinds[m] == COMPUTE) {
+      int icompute = modify->find_compute(id);
+      if (icompute < 0)
+        error->all(FLERR,"Compute ID for fix dump mesh does not exist");
+      Compute* compute = modify->compute[icompute];
+      if (compute->peratom_flag == 0)
+        error->all(FLERR,"Fix dump mesh compute does not calculate per-atom values");
+      if (column == 0 && compute->size_peratom_cols != 0)
+        error->all(FLERR,"Fix dump mesh compute does not calculate a per-atom vector");
+      if (column && compute->size_peratom_cols == 0)
+        error->all(FLERR,"Fix dump mesh compute does not calculate a per-atom array");
+      if (column > compute->size_peratom_cols && compute->size_peratom_cols)
+        error->all(FLERR,"Fix dump mesh compute vector is accessed out-of-range");
+    } else if (m_attributeKinds[m] == FIX) {
+      int ifix = modify->find_fix(id);
+      if (ifix < 0)
+        error->all(FLERR,"Fix ID for fix dump mesh does not exist");
+      Fix* fix = modify->fix[ifix];
+      if (fix->peratom_flag == 0)
+        error->all(FLERR,"Fix dump mesh fix does not calculate per-atom values");
+      if (column == 0 && fix->size_peratom_cols != 0)
+        error->all(FLERR,"Fix dump mesh fix does not calculate a per-atom vector");
+      if (column && fix->size_peratom_cols == 0)
+        error->all(FLERR,"Fix dump mesh fix does not calculate a per-atom array");
+      if (column > fix->size_peratom_cols && fix->size_peratom_cols)
+        error->all(FLERR,"Fix dump mesh fix vector is accessed out-of-range");
+    } else if (m_attributeKinds[m] == VARIABLE) {
+      int ivariable = input->variable->find(id);
+      if (ivariable < 0)
+        error->all(FLERR,"Variable name for fix dump mesh does not exist");
+      if (input->variable->atomstyle(ivariable) == 0)
+        error->all(FLERR,"Fix dump mesh variable is not atom-style variable");
+    }
+  }
+
+  QuantizationOptions quantization;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "format") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_format = std::string(arg[iarg + 1]);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "async") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_framesInFlight = atoi(arg[iarg + 1]);
+      if (m_framesInFlight <= 0) error->all(FLERR,"Illegal fix dump mesh command: async must be positive integer");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "quantize") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      if (strcmp(arg[iarg + 1], "bbox") == 0) quantization.useDomain = false;
+      else if (strcmp(arg[iarg + 1], "domain") == 0) quantization.useDomain = true;
+      else error->all(FLERR,"Illegal fix dump mesh command: quantize must be bbox or domain");
+      quantization.enabled = true;
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "delta") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      quantization.keyframeInterval = atoi(arg[iarg + 1]);
+      if (quantization.keyframeInterval <= 0)
+        error->all(FLERR,"Illegal fix dump mesh command: delta must be positive integer");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "compress") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      if (strcmp(arg[iarg + 1], "yes") == 0) quantization.compress = true;
+      else if (strcmp(arg[iarg + 1], "no") == 0) quantization.compress = false;
+      else error->all(FLERR,"Illegal fix dump mesh command");
+      if (quantization.compress && !QuantizedFrameEncoder::compressionAvailable())
+        error->all(FLERR,"Fix dump mesh compress requires compiling with -DMESH_TRAJECTORY_ZLIB");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "unwrap") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      if (strcmp(arg[iarg + 1], "image") == 0) m_moleculeUnwrap = false;
+      else if (strcmp(arg[iarg + 1], "molecule") == 0) m_moleculeUnwrap = true;
+      else error->all(FLERR,"Illegal fix dump mesh command: unwrap must be image or molecule");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "partition") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_partitionWriters = atoi(arg[iarg + 1]);
+      if (m_partitionWriters <= 0)
+        error->all(FLERR,"Illegal fix dump mesh command: partition must be positive integer");
+      m_partitionWriters = std::min(m_partitionWriters, comm->nprocs);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "preview") == 0) {
+      if (iarg + 3 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_previewEvery = atoi(arg[iarg + 1]);
+      m_previewRings = atoi(arg[iarg + 2]);
+      if (m_previewEvery <= 0 || m_previewRings <= 0)
+        error->all(FLERR,"Illegal fix dump mesh command: preview arguments must be positive integers");
+      iarg += 3;
+    } else if (strcmp(arg[iarg], "trigger") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_triggerDistance = atof(arg[iarg + 1]);
+      if (m_triggerDistance <= 0.0)
+        error->all(FLERR,"Illegal fix dump mesh command: trigger must be positive");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "min") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_minInterval = atoi(arg[iarg + 1]);
+      if (m_minInterval < 0) error->all(FLERR,"Illegal fix dump mesh command: min must be non-negative");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "max") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix dump mesh command");
+      m_maxInterval = atoi(arg[iarg + 1]);
+      if (m_maxInterval <= 0) error->all(FLERR,"Illegal fix dump mesh command: max must be positive integer");
+      iarg += 2;
+    } else error->all(FLERR,"Illegal fix dump mesh command");
+  }
+  if ((m_minInterval || m_maxInterval) && m_triggerDistance == 0.0)
+    error->all(FLERR,"Illegal fix dump mesh command: min and max require trigger");
+  if (m_maxInterval && m_maxInterval < m_minInterval)
+    error->all(FLERR,"Illegal fix dump mesh command: max must not be smaller than min");
+
+  // reference positions migrate with atoms
+  if (m_triggerDistance > 0.0) {
+    create_attribute = 1;
+    grow_arrays(atom->nmax);
+    atom->add_callback(0);
+    for (int i = 0; i < atom->nlocal; ++i)
+      set_arrays(i);
+  }
+  if (m_framesInFlight && m_format == "traj/mpiio")
+    error->all(FLERR,"Illegal fix dump mesh command: async can not be used with traj/mpiio");
+  if (m_moleculeUnwrap && !atom->molecular)
+    error->all(FLERR,"Fix dump mesh unwrap molecule requires molecular system");
+  if (quantization.enabled && m_format != "traj")
+    error->all(FLERR,"Illegal fix dump mesh command: quantize can be used only with traj");
+  if ((quantization.keyframeInterval > 1 || quantization.compress) && !quantization.enabled)
+    error->all(FLERR,"Illegal fix dump mesh command: delta and compress require quantize");
+
+  if (m_partitionWriters && !atom->molecular)
+    error->all(FLERR,"Fix dump mesh partition requires molecular system");
+  if (m_partitionWriters && (m_format != "obj" || m_framesInFlight))
+    error->all(FLERR,"Illegal fix dump mesh command: partition can be used only with obj format without async");
+  if (m_partitionWriters && m_previewEvery)
+    error->all(FLERR,"Illegal fix dump mesh command: preview can not be used with partition");
+
+  // the fix is called on steps of both streams
+  if (m_previewEvery) {
+    int a = m_dumpEvery, b = m_previewEvery;
+    while (b) {
+      int rest = a % b;
+      a = b;
+      b = rest;
+    }
+    nevery = a;
+  }
+
+  // with partition writer w is proc w * nprocs / W and writes template.part<w>.<frame>.obj
+  bool isWriter = comm->me == 0;
+  std::string writerTemplate = m_fileNameTemplate;
+  if (m_partitionWriters) {
+    isWriter = false;
+    for (int w = 0; w < m_partitionWriters; ++w) {
+      if (static_cast<bigint>(w) * comm->nprocs / m_partitionWriters == comm->me) {
+        std::ostringstream name;
+        name << m_fileNameTemplate << ".part" << w;
+        writerTemplate = name.str();
+        isWriter = true;
+      }
+    }
+  }
+
+  if (m_format == "traj/mpiio") {
+    try
+    {
+      m_parallelWriter = new ParallelMeshTrajectoryWriter(m_fileNameTemplate + ".traj", world);
+      if (!m_attributeNames.empty())
+        m_parallelWriter->writeAttributeNames(m_attributeNames);
+    }
+    catch(std::exception& e)
+    {
+      error->all(FLERR, e.what());
+    }
+  } else if (isWriter) {
+    try
+    {
+      m_writer = createMeshWriter(m_format, writerTemplate, quantization);
+      if (m_writer && !m_attributeNames.empty())
+        m_writer->setAttributeNames(m_attributeNames);
+    }
+    catch(std::exception& e)
+    {
+      error->one(FLERR, e.what());
+    }
+    if (m_writer == 0) error->one(FLERR,"Illegal fix dump mesh command: unknown format");
+    if (m_framesInFlight) {
+      try
+      {
+        m_asyncWriter = new AsyncMeshWriter(m_writer, m_framesInFlight);
+        m_writer = m_asyncWriter;
+      }
+      catch(std::exception& e)
+      {
+        error->one(FLERR, e.what());
+      }
+    }
+  }
+
+  // preview is small, it is written by root synchronously, traj/mpiio previews are written to serial traj
+  if (m_previewEvery && comm->me == 0) {
+    try
+    {
+      m_previewWriter = createMeshWriter(m_format == "traj/mpiio" ? "traj" : m_format, m_fileNameTemplate + ".lod");
+      if (!m_attributeNames.empty())
+        m_previewWriter->setAttributeNames(m_attributeNames);
+    }
+    catch(std::exception& e)
+    {
+      error->one(FLERR, e.what());
+    }
+  }
 }
 
 /* ---------------------------------------------------------------------- */
 
 FixDumpMesh::~FixDumpMesh()
 {
+  if (m_recordType != MPI_DATATYPE_NULL)
+    MPI_Type_free(&m_recordType);
+  delete m_writer;
+  delete m_parallelWriter;
+  delete m_previewWriter;
+  delete m_moleculeCounter;
+  if (m_xref) {
+    atom->delete_callback(id, 0);
+    memory->destroy(m_xref);
+  }
 }
 
 /* ---------------------------------------------------------------------- */
@@ -70,12 +364,59 @@ int FixDumpMesh::setmask()
   return mask;
 }
 
+/* ----------------------------------------------------------------------
+   set indices of computes, fixes and variables used as attributes
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::init()
+{
+  for (size_t m = 0; m < m_attributeKinds.size(); ++m) {
+    char* id = const_cast<char*>(m_attributeIds[m].c_str());
+    if (m_attributeKinds[m] == COMPUTE) {
+      int icompute = modify->find_compute(id);
+      if (icompute < 0)
+        error->all(FLERR,"Compute ID for fix dump mesh does not exist");
+      m_attributeIndices[m] = icompute;
+    } else if (m_attributeKinds[m] == FIX) {
+      int ifix = modify->find_fix(id);
+      if (ifix < 0)
+        error->all(FLERR,"Fix ID for fix dump mesh does not exist");
+      m_attributeIndices[m] = ifix;
+      if (nevery % modify->fix[ifix]->peratom_freq)
+        error->all(FLERR,"Fix for fix dump mesh not computed at compatible time");
+    } else if (m_attributeKinds[m] == VARIABLE) {
+      int ivariable = input->variable->find(id);
+      if (ivariable < 0)
+        error->all(FLERR,"Variable name for fix dump mesh does not exist");
+      m_attributeIndices[m] = ivariable;
+    }
+  }
+}
+
 /* ---------------------------------------------------------------------- */
 
 void FixDumpMesh::setup(int)
 {
+  createRecordType();
+  buildMesh();
+}
+
+/* ----------------------------------------------------------------------
+   builds vertex tables and faces from scratch
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::buildMesh()
+{
+  if (m_moleculeUnwrap)
+    findReferenceTags();
+  if (m_partitionWriters) {
+    buildPartition();
+    computeChecksums(m_checksums);
+    return;
+  }
+
   // contruct mapping from vertices indices in obj file to tags we are interested in
-  std::vector<int> localVertInd2Tag;
+  std::vector<tagint> localVertInd2Tag;
   for (int i = 0; i < atom->nlocal; ++i) {
     if (atom->mask[i] & groupbit) {
       localVertInd2Tag.push_back( atom->tag[i] );
@@ -84,92 +425,888 @@ void FixDumpMesh::setup(int)
   int nlocalParticles = localVertInd2Tag.size();
   MPI_Allreduce(&nlocalParticles, &m_nglobalParticles, 1, MPI_INT, MPI_SUM, world);
 
-  std::vector<int> globalVertInd2Tag;
-  allGatherUnionOfContainers(localVertInd2Tag, world, globalVertInd2Tag);
-  std::sort(globalVertInd2Tag.begin(), globalVertInd2Tag.end());
-  for (int i = 0; i < (int)globalVertInd2Tag.size(); ++i) {
-    put(globalVertInd2Tag[i], i, m_tags2VertInd);
+  // only root keeps all tags, memory of other procs scales with the number of local atoms
+  std::vector<tagint> globalVertInd2Tag;
+  gatherUnionOfContainers(localVertInd2Tag, world, 0, globalVertInd2Tag);
+  if (comm->me == 0)
+    std::sort(globalVertInd2Tag.begin(), globalVertInd2Tag.end());
+
+  // dense table from tag to vertex index, root uses the whole table to convert faces
+  buildVertexTable(globalVertInd2Tag, 0);
+
+  if (m_parallelWriter) {
+    // vertex range of proc p is [N*p/nprocs, N*(p+1)/nprocs), splitters are the first tags of ranges,
+    // root sends every proc its range of sorted tags
+    int nprocs = comm->nprocs;
+    int nvertices = m_nglobalParticles;
+    std::vector<int> counts(nprocs), displs(nprocs);
+    m_splitters.resize(nprocs);
+    for (int p = 0; p < nprocs; ++p) {
+      displs[p] = static_cast<bigint>(nvertices) * p / nprocs;
+      counts[p] = static_cast<bigint>(nvertices) * (p + 1) / nprocs - displs[p];
+      if (comm->me == 0)
+        m_splitters[p] = displs[p] < nvertices ? globalVertInd2Tag[displs[p]] : (nvertices ? globalVertInd2Tag.back() + 1 : 0);
+    }
+    MPI_Bcast(&m_splitters[0], nprocs, MPI_LMP_TAGINT, 0, world);
+
+    std::vector<tagint> localSortedTags(counts[comm->me]);
+    MPI_Scatterv(globalVertInd2Tag.empty() ? 0 : &globalVertInd2Tag[0], &counts[0], &displs[0], MPI_LMP_TAGINT,
+                 localSortedTags.empty() ? 0 : &localSortedTags[0], counts[comm->me], MPI_LMP_TAGINT, 0, world);
+    m_globalTags2VertInd.swap(m_tags2VertInd);
+    m_globalMinTag = m_minTag;
+    buildVertexTable(localSortedTags, displs[comm->me]);
+    m_sendCounts.resize(nprocs);
+  }
+
+  // collect all triangles, later only changes are sent
+  collectLocalFaces(m_localFaces);
+  std::vector<tagint> localTriangulation;
+  for (size_t i = 0; i < m_localFaces.size(); ++i)
+    localTriangulation.insert(localTriangulation.end(), m_localFaces[i].v, m_localFaces[i].v + 3);
+  std::vector<tagint> triangulation; // triangles indices, linearized, tags
+  gatherUnionOfContainers(localTriangulation, world, 0, triangulation);
+  m_faceCounts.clear();
+  applyFaceChanges(triangulation, std::vector<tagint>());
+  publishFaces();
+
+  computeChecksums(m_checksums);
+}
+
+/* ----------------------------------------------------------------------
+   with partition molecules are split into contiguous blocks between writer procs,
+   every writer owns vertices and faces of its molecules, vertices are ordered
+   by molecule and tag so every molecule is a contiguous object
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::buildPartition()
+{
+  if (!m_moleculeUnwrap) {
+    if (!m_moleculeCounter)
+      m_moleculeCounter = new MoleculeCounter(lmp);
+    m_moleculeCounter->run(groupbit);
+  }
+
+  int nprocs = comm->nprocs;
+  int nlocalParticles = 0, freeParticles = 0;
+  std::vector<std::vector<tagint> > vertexBuckets(nprocs), faceBuckets(nprocs);
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if (!(atom->mask[i] & groupbit))
+      continue;
+    ++nlocalParticles;
+    int imol = atom->molecule[i] != 0 ? m_moleculeCounter->getMolIDbyAtom(i) : -1;
+    if (imol < 0) {
+      ++freeParticles;
+      continue;
+    }
+    int owner = getPartitionOwner(imol);
+    vertexBuckets[owner].push_back(atom->molecule[i]);
+    vertexBuckets[owner].push_back(atom->tag[i]);
+
+    // every angle is taken by the owner of its central atom
+    for (int m = 0; m < atom->num_angle[i]; ++m) {
+      if (atom->angle_atom2[i][m] != atom->tag[i])
+        continue;
+      faceBuckets[owner].push_back(atom->angle_atom1[i][m]);
+      faceBuckets[owner].push_back(atom->angle_atom2[i][m]);
+      faceBuckets[owner].push_back(atom->angle_atom3[i][m]);
+    }
+  }
+  MPI_Allreduce(&nlocalParticles, &m_nglobalParticles, 1, MPI_INT, MPI_SUM, world);
+  int nfreeParticles = 0;
+  MPI_Allreduce(&freeParticles, &nfreeParticles, 1, MPI_INT, MPI_SUM, world);
+  if (nfreeParticles)
+    error->all(FLERR,"Fix dump mesh partition requires all atoms in group to belong to molecules");
+
+  std::vector<int> vertexCounts(nprocs), faceCounts(nprocs);
+  std::vector<tagint> localVertices, localFaces;
+  for (int p = 0; p < nprocs; ++p) {
+    vertexCounts[p] = vertexBuckets[p].size();
+    faceCounts[p] = faceBuckets[p].size();
+    localVertices.insert(localVertices.end(), vertexBuckets[p].begin(), vertexBuckets[p].end());
+    localFaces.insert(localFaces.end(), faceBuckets[p].begin(), faceBuckets[p].end());
+  }
+  std::vector<tagint> ownedVertices, ownedFaces;
+  exchangeContainers(localVertices, vertexCounts, world, ownedVertices);
+  exchangeContainers(localFaces, faceCounts, world, ownedFaces);
+
+  // [molecule, tag] pairs sorted by molecule and tag
+  std::vector<std::pair<tagint, tagint> > vertices(ownedVertices.size() / 2);
+  for (size_t k = 0; k < vertices.size(); ++k)
+    vertices[k] = std::make_pair(ownedVertices[2 * k], ownedVertices[2 * k + 1]);
+  std::sort(vertices.begin(), vertices.end());
+
+  std::vector<tagint> tags(vertices.size());
+  std::vector<MeshObject> objects;
+  for (size_t k = 0; k < vertices.size(); ++k) {
+    tags[k] = vertices[k].second;
+    if (k == 0 || vertices[k].first != vertices[k - 1].first) {
+      std::ostringstream name;
+      name << "molecule" << vertices[k].first;
+      MeshObject object = {name.str(), static_cast<int>(k), 0, 0, 0};
+      objects.push_back(object);
+    }
+    ++objects.back().nvertices;
+  }
+  buildVertexTable(tags, 0);
+  m_sendCounts.assign(nprocs, 0);
+
+  // faces are grouped by object of their first vertex
+  std::vector<int> objectFirstVertices(objects.size());
+  for (size_t k = 0; k < objects.size(); ++k)
+    objectFirstVertices[k] = objects[k].firstVertex;
+  size_t nfaces = ownedFaces.size() / 3;
+  std::vector<int> faceObjects(nfaces);
+  std::vector<int> faceVertices(ownedFaces.size());
+  try
+  {
+    for (size_t f = 0; f < nfaces; ++f) {
+      for (int c = 0; c < 3; ++c)
+        faceVertices[3 * f + c] = get(m_tags2VertInd, m_minTag, ownedFaces[3 * f + c]);
+      faceObjects[f] = std::upper_bound(objectFirstVertices.begin(), objectFirstVertices.end(), faceVertices[3 * f])
+                       - objectFirstVertices.begin() - 1;
+      ++objects[faceObjects[f]].nfaces;
+    }
+  }
+  catch(...)
+  {
+    error->one(FLERR, "Fix dump mesh partition requires angles to connect atoms of the same molecule in group");
   }
+  for (size_t k = 1; k < objects.size(); ++k)
+    objects[k].firstFace = objects[k - 1].firstFace + objects[k - 1].nfaces;
 
-  // collect all relevant triangles, assumed that topology is constant during the run
-  std::vector<int> localTriangulation;
+  std::vector<int> offsets(objects.size());
+  for (size_t k = 0; k < objects.size(); ++k)
+    offsets[k] = objects[k].firstFace;
+  m_faces.resize(ownedFaces.size());
+  for (size_t f = 0; f < nfaces; ++f) {
+    int slot = offsets[faceObjects[f]]++;
+    std::copy(&faceVertices[3 * f], &faceVertices[3 * f] + 3, &m_faces[3 * slot]);
+  }
+
+  // owners are always writer procs
+  if (m_writer) {
+    m_writer->setObjects(objects);
+    m_writer->setFaces(m_faces);
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixDumpMesh::getPartitionOwner(int imol) const
+{
+  int nmolecules = m_moleculeCounter->getMolNum();
+  int writer = static_cast<bigint>(imol) * m_partitionWriters / nmolecules;
+  return static_cast<bigint>(writer) * comm->nprocs / m_partitionWriters;
+}
+
+/* ----------------------------------------------------------------------
+   every angle is taken by the owner of its central atom,
+   so it is counted once for any newton_bond setting
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::collectLocalFaces(std::vector<Face>& faces) const
+{
+  faces.clear();
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if (atom->mask[i] & groupbit) {
+      int num_angle = atom->num_angle[i];
+      for (int m = 0; m < num_angle; ++m) {
+        if (atom->angle_atom2[i][m] != atom->tag[i])
+          continue;
+        Face face = {{atom->angle_atom1[i][m], atom->angle_atom2[i][m], atom->angle_atom3[i][m]}};
+        faces.push_back(face);
+      }
+    }
+  }
+  std::sort(faces.begin(), faces.end());
+}
+
+/* ----------------------------------------------------------------------
+   global number and hash sum of vertices and faces, they do not change
+   when atoms migrate, so they detect topology changes with one collective
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::computeChecksums(unsigned long long* checksums) const
+{
+  unsigned long long local[NCHECKSUMS] = {0ULL, 0ULL, 0ULL, 0ULL};
   for (int i = 0; i < atom->nlocal; ++i) {
     if (atom->mask[i] & groupbit) {
+      ++local[NVERTICES];
+      local[VERTICES_HASH] += mix(atom->tag[i]);
       int num_angle = atom->num_angle[i];
       for (int m = 0; m < num_angle; ++m) {
-        localTriangulation.push_back(atom->angle_atom1[i][m]);
-        localTriangulation.push_back(atom->angle_atom2[i][m]);
-        localTriangulation.push_back(atom->angle_atom3[i][m]);
+        if (atom->angle_atom2[i][m] != atom->tag[i])
+          continue;
+        ++local[NFACES];
+        local[FACES_HASH] += mix(atom->angle_atom1[i][m] ^ mix(atom->angle_atom2[i][m] ^ mix(atom->angle_atom3[i][m])));
       }
     }
   }
-  gatherUnionOfContainers(localTriangulation, world, 0, m_triangulation);
+  MPI_Allreduce(local, checksums, NCHECKSUMS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, world);
+}
+
+/* ----------------------------------------------------------------------
+   procs send triangles added and removed since their last update,
+   triangles moved to another proc appear in both lists and cancel on root
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::updateFaces()
+{
+  std::vector<Face> faces;
+  collectLocalFaces(faces);
+
+  std::vector<Face> added, removed;
+  std::set_difference(faces.begin(), faces.end(), m_localFaces.begin(), m_localFaces.end(), std::back_inserter(added));
+  std::set_difference(m_localFaces.begin(), m_localFaces.end(), faces.begin(), faces.end(), std::back_inserter(removed));
+  m_localFaces.swap(faces);
+
+  std::vector<tagint> localAdded, localRemoved, globalAdded, globalRemoved;
+  for (size_t i = 0; i < added.size(); ++i)
+    localAdded.insert(localAdded.end(), added[i].v, added[i].v + 3);
+  for (size_t i = 0; i < removed.size(); ++i)
+    localRemoved.insert(localRemoved.end(), removed[i].v, removed[i].v + 3);
+  gatherUnionOfContainers(localAdded, world, 0, globalAdded);
+  gatherUnionOfContainers(localRemoved, world, 0, globalRemoved);
+
+  applyFaceChanges(globalAdded, globalRemoved);
+  publishFaces();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixDumpMesh::applyFaceChanges(const std::vector<tagint>& added, const std::vector<tagint>& removed)
+{
+  if (comm->me != 0)
+    return;
+  for (size_t i = 0; i < added.size(); i += 3) {
+    Face face = {{added[i], added[i + 1], added[i + 2]}};
+    ++m_faceCounts[face];
+  }
+  for (size_t i = 0; i < removed.size(); i += 3) {
+    Face face = {{removed[i], removed[i + 1], removed[i + 2]}};
+    std::map<Face, int>::iterator it = m_faceCounts.find(face);
+    if (it == m_faceCounts.end())
+      continue;
+    if (--it->second == 0)
+      m_faceCounts.erase(it);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   converts faces to vertex indices and passes them to the writer
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::publishFaces()
+{
+  m_faces.clear();
+  if (comm->me == 0) {
+    const std::vector<int>& table = m_parallelWriter ? m_globalTags2VertInd : m_tags2VertInd;
+    tagint minTag = m_parallelWriter ? m_globalMinTag : m_minTag;
+    try
+    {
+      for (std::map<Face, int>::const_iterator it = m_faceCounts.begin(); it != m_faceCounts.end(); ++it) {
+        for (int n = 0; n < it->second; ++n) {
+          m_faces.push_back(get(table, minTag, it->first.v[0]));
+          m_faces.push_back(get(table, minTag, it->first.v[1]));
+          m_faces.push_back(get(table, minTag, it->first.v[2]));
+        }
+      }
+    }
+    catch(...)
+    {
+      error->one(FLERR, "Internal error: tags mapping is invalid");
+    }
+    if (m_writer)
+      m_writer->setFaces(m_faces);
+  }
+
+  if (m_parallelWriter) {
+    try
+    {
+      m_parallelWriter->writeTopology(update->ntimestep, m_nglobalParticles, m_faces);
+    }
+    catch(std::exception& e)
+    {
+      error->all(FLERR, e.what());
+    }
+  }
+
+  if (m_previewEvery)
+    buildPreview();
 }
 
 /* ---------------------------------------------------------------------- */
 
 void FixDumpMesh::end_of_step()
 {
-  std::vector<float> localAtoms; // linearized array [tag, x, y ,z]
-  localAtoms.reserve(m_nglobalParticles);
-  for (int i = 0; i < atom->nlocal; ++i) {
+  bool dumpStep = update->ntimestep % m_dumpEvery == 0;
+  bool previewStep = m_previewEvery && update->ntimestep % m_previewEvery == 0;
+  if (dumpStep && m_triggerDistance > 0.0 && !isTriggered())
+    dumpStep = false;
+  if (!dumpStep && !previewStep) {
+    if (!m_attributeKinds.empty())
+      modify->addstep_compute(update->ntimestep + nevery);
+    return;
+  }
+
+  checkWriterError();
+
+  unsigned long long checksums[NCHECKSUMS];
+  computeChecksums(checksums);
+  if (checksums[NVERTICES] != m_checksums[NVERTICES] || checksums[VERTICES_HASH] != m_checksums[VERTICES_HASH]) {
+    buildMesh();
+  } else if (checksums[NFACES] != m_checksums[NFACES] || checksums[FACES_HASH] != m_checksums[FACES_HASH]) {
+    if (m_partitionWriters)
+      buildMesh();
+    else
+      updateFaces();
+    std::copy(checksums, checksums + NCHECKSUMS, m_checksums);
+  }
+
+  if (m_moleculeUnwrap)
+    updateReferenceImages();
+  computeAttributes();
+
+  if (previewStep)
+    writePreview();
+  if (!dumpStep)
+    return;
+
+  int nlocal = atom->nlocal;
+  int nlocalParticles = 0;
+  for (int i = 0; i < nlocal; ++i) {
+    if (atom->mask[i] & groupbit)
+      ++nlocalParticles;
+  }
+
+  // with traj/mpiio and partition records are grouped by the proc owning the vertex
+  bool routed = m_parallelWriter || m_partitionWriters;
+  if (routed) {
+    std::fill(m_sendCounts.begin(), m_sendCounts.end(), 0);
+    m_recordOwners.resize(nlocalParticles);
+    for (int i = 0, r = 0; i < nlocal; ++i) {
+      if (atom->mask[i] & groupbit) {
+        int owner = m_partitionWriters ? getPartitionOwner(m_moleculeCounter->getMolIDbyAtom(i)) :
+                    std::upper_bound(m_splitters.begin(), m_splitters.end(), atom->tag[i]) - m_splitters.begin() - 1;
+        m_recordOwners[r++] = owner;
+        ++m_sendCounts[owner];
+      }
+    }
+  }
+  std::vector<int> ownerOffsets(m_sendCounts.size(), 0);
+  for (size_t p = 1; p < m_sendCounts.size(); ++p)
+    ownerOffsets[p] = ownerOffsets[p - 1] + m_sendCounts[p - 1];
+
+  // pack local unwrapped vertices into records, buffers keep their capacity between frames
+  m_localRecords.resize(static_cast<size_t>(nlocalParticles) * m_recordSize);
+  for (int i = 0, r = 0; i < nlocal; ++i) {
     if (atom->mask[i] & groupbit) {
-      localAtoms.push_back( static_cast<float>(atom->tag[i]) );
-      localAtoms.push_back( static_cast<float>(atom->x[i][0]) );
-      localAtoms.push_back( static_cast<float>(atom->x[i][1]) );
-      localAtoms.push_back( static_cast<float>(atom->x[i][2]) );
+      int slot = routed ? ownerOffsets[m_recordOwners[r]]++ : r;
+      packRecord(i, &m_localRecords[static_cast<size_t>(slot) * m_recordSize]);
+      ++r;
+    }
+  }
+  if (routed)
+    exchangeRecords(m_localRecords, m_sendCounts, m_recordType, world, m_globalRecords);
+  else
+    gatherRecords(m_localRecords, m_recordType, world, 0, m_globalRecords);
+
+  // every vertex is placed directly at its index, O(N) and no sorting
+  if (routed || comm->me == 0) {
+    try
+    {
+      size_t nrecords = m_globalRecords.size() / m_recordSize;
+      for (size_t r = 0; r < nrecords; ++r) {
+        char* rec = &m_globalRecords[r * m_recordSize];
+        int vi = get(m_tags2VertInd, m_minTag, recordTag(rec));
+        std::copy(recordValues(rec), recordValues(rec) + m_nfields, &m_positions[static_cast<size_t>(vi) * m_nfields]);
+      }
+    }
+    catch(...)
+    {
+      error->one(FLERR, "Internal error: tags mapping is invalid");
     }
   }
-  std::vector<float> globalUnionVector;
-  gatherUnionOfContainers(localAtoms, world, 0, globalUnionVector);
 
-  std::string fileName = m_fileNameTemplate + "." + std::to_string(update->ntimestep/nevery) + ".obj";
-  writeObj(fileName, globalUnionVector);
+  if (m_parallelWriter) {
+    try
+    {
+      m_parallelWriter->writeFrame(update->ntimestep, m_nglobalParticles, m_nfields, m_firstVertex,
+                                   m_positions.size() / m_nfields, m_positions.empty() ? 0 : &m_positions[0]);
+    }
+    catch(std::exception& e)
+    {
+      error->all(FLERR, e.what());
+    }
+    return;
+  }
+
+  // root or, with partition, every writer proc
+  if (m_writer) {
+    MeshFrame frame;
+    frame.timestep = update->ntimestep;
+    frame.index = update->ntimestep/m_dumpEvery;
+    frame.nvertices = m_positions.size() / m_nfields;
+    frame.stride = m_nfields;
+    frame.data = m_positions.empty() ? 0 : &m_positions[0];
+    for (int c = 0; c < 3; ++c) {
+      frame.boxlo[c] = domain->triclinic ? domain->boxlo_bound[c] : domain->boxlo[c];
+      frame.boxhi[c] = domain->triclinic ? domain->boxhi_bound[c] : domain->boxhi[c];
+    }
+    try
+    {
+      if (m_asyncWriter)
+        m_asyncWriter->submit(frame, m_positions); // m_positions is replaced by a recycled buffer
+      else
+        m_writer->write(frame);
+    }
+    catch(std::exception& e)
+    {
+      error->one(FLERR, e.what());
+    }
+  }
 }
 
 /* ---------------------------------------------------------------------- */
 
-void FixDumpMesh::writeObj(const std::string& fileName, std::vector<float>& positions)
+void FixDumpMesh::post_run()
 {
-  try
-  {
-    if (comm->me == 0) {
-      std::ofstream file(fileName.c_str());
-      if (!file.is_open()) {
-        error->all(FLERR, "could not open output file");
-      } else {
-        std::string objName = "Mesh";
-        file << "# Generate by FixDumpMesh" << std::endl << "o " + objName << std::endl;
+  if (m_asyncWriter)
+    m_asyncWriter->drain();
+  checkWriterError();
+}
+
+/* ----------------------------------------------------------------------
+   decides if the frame is written, the same on all procs
+   intervals are checked first so the displacement reduction is skipped if possible
+------------------------------------------------------------------------- */
+
+bool FixDumpMesh::isTriggered()
+{
+  bool triggered = false;
+  if (m_lastDumpStep < 0) {
+    triggered = true;
+  } else {
+    bigint elapsed = update->ntimestep - m_lastDumpStep;
+    if (elapsed < m_minInterval)
+      return false;
+    if (m_maxInterval && elapsed >= m_maxInterval) {
+      triggered = true;
+    } else {
+      double localMax = 0.0;
+      for (int i = 0; i < atom->nlocal; ++i) {
+        if (atom->mask[i] & groupbit) {
+          double xu[3];
+          domain->unmap(atom->x[i], atom->image[i], xu);
+          double dx = xu[0] - m_xref[i][0];
+          double dy = xu[1] - m_xref[i][1];
+          double dz = xu[2] - m_xref[i][2];
+          localMax = std::max(localMax, dx*dx + dy*dy + dz*dz);
+        }
       }
+      double globalMax = 0.0;
+      MPI_Allreduce(&localMax, &globalMax, 1, MPI_DOUBLE, MPI_MAX, world);
+      triggered = globalMax > m_triggerDistance * m_triggerDistance;
+    }
+  }
+  if (triggered)
+    storeReferencePositions();
+  return triggered;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixDumpMesh::storeReferencePositions()
+{
+  m_lastDumpStep = update->ntimestep;
+  for (int i = 0; i < atom->nlocal; ++i)
+    set_arrays(i);
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixDumpMesh::memory_usage()
+{
+  return m_xref ? atom->nmax * 3 * sizeof(double) : 0.0;
+}
+
+/* ---------------------------------------------------------------------- */
 
-      if (sizeof(Point) != 4 * sizeof(float)) {
-        error->one(FLERR, "Internal error: point structure has unexpected padding");
+void FixDumpMesh::grow_arrays(int nmax)
+{
+  memory->grow(m_xref, nmax, 3, "dump/mesh:xref");
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixDumpMesh::copy_arrays(int i, int j, int)
+{
+  std::copy(m_xref[i], m_xref[i] + 3, m_xref[j]);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixDumpMesh::set_arrays(int i)
+{
+  domain->unmap(atom->x[i], atom->image[i], m_xref[i]);
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixDumpMesh::pack_exchange(int i, double* buf)
+{
+  std::copy(m_xref[i], m_xref[i] + 3, buf);
+  return 3;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixDumpMesh::unpack_exchange(int nlocal, double* buf)
+{
+  std::copy(buf, buf + 3, m_xref[nlocal]);
+  return 3;
+}
+
+/* ----------------------------------------------------------------------
+   errors of the background writer are known only on root,
+   they are reported by all procs at the next collective point
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::checkWriterError()
+{
+  if (!m_framesInFlight)
+    return;
+
+  std::string message;
+  int failed = 0;
+  if (m_asyncWriter)
+    failed = m_asyncWriter->getError(message);
+  MPI_Bcast(&failed, 1, MPI_INT, 0, world);
+  if (failed) {
+    message = "Fix dump mesh could not write frame: " + message;
+    error->all(FLERR, message.c_str());
+  }
+}
+
+/* ----------------------------------------------------------------------
+   reference vertex of a molecule is its vertex with the smallest tag
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::findReferenceTags()
+{
+  if (!m_moleculeCounter)
+    m_moleculeCounter = new MoleculeCounter(lmp);
+  m_moleculeCounter->run(groupbit);
+  int nmolecules = m_moleculeCounter->getMolNum();
+
+  std::vector<tagint> localTags(nmolecules, std::numeric_limits<tagint>::max());
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if ((atom->mask[i] & groupbit) && atom->molecule[i] != 0) {
+      int imol = m_moleculeCounter->getMolIDbyAtom(i);
+      if (imol >= 0)
+        localTags[imol] = std::min(localTags[imol], atom->tag[i]);
+    }
+  }
+  m_referenceTags.resize(nmolecules);
+  if (nmolecules)
+    MPI_Allreduce(&localTags[0], &m_referenceTags[0], nmolecules, MPI_LMP_TAGINT, MPI_MIN, world);
+  m_localReferenceImages.resize(3 * nmolecules);
+  m_referenceImages.resize(3 * nmolecules);
+}
+
+/* ----------------------------------------------------------------------
+   owners of reference vertices share their image flags, one collective for all molecules
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::updateReferenceImages()
+{
+  std::fill(m_localReferenceImages.begin(), m_localReferenceImages.end(), 0);
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if ((atom->mask[i] & groupbit) && atom->molecule[i] != 0) {
+      int imol = m_moleculeCounter->getMolIDbyAtom(i);
+      if (imol >= 0 && atom->tag[i] == m_referenceTags[imol]) {
+        imageint image = atom->image[i];
+        m_localReferenceImages[3 * imol] = (image & IMGMASK) - IMGMAX;
+        m_localReferenceImages[3 * imol + 1] = (image >> IMGBITS & IMGMASK) - IMGMAX;
+        m_localReferenceImages[3 * imol + 2] = (image >> IMG2BITS) - IMGMAX;
       }
+    }
+  }
+  if (!m_referenceImages.empty())
+    MPI_Allreduce(&m_localReferenceImages[0], &m_referenceImages[0], m_referenceImages.size(),
+                  MPI_INT, MPI_SUM, world);
+}
+
+/* ----------------------------------------------------------------------
+   unwrapped coordinates of local atom i, with unwrap molecule relative
+   to the image of the molecule reference vertex
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::unwrap(int i, double* xu) const
+{
+  imageint image = atom->image[i];
+  if (m_moleculeUnwrap && atom->molecule[i] != 0) {
+    int imol = m_moleculeCounter->getMolIDbyAtom(i);
+    if (imol >= 0) {
+      const int* reference = &m_referenceImages[3 * imol];
+      imageint xbox = (image & IMGMASK) - reference[0];
+      imageint ybox = (image >> IMGBITS & IMGMASK) - reference[1];
+      imageint zbox = (image >> IMG2BITS) - reference[2];
+      image = (xbox & IMGMASK) | ((ybox & IMGMASK) << IMGBITS) | ((zbox & IMGMASK) << IMG2BITS);
+    }
+  }
+  domain->unmap(atom->x[i], image, xu);
+}
+
+/* ----------------------------------------------------------------------
+   vertex record [tag, unwrapped x, y, z, attributes] of local atom i
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::packRecord(int i, char* record) const
+{
+  recordTag(record) = atom->tag[i];
+  double xu[3];
+  unwrap(i, xu);
+  float* values = recordValues(record);
+  values[0] = static_cast<float>(xu[0]);
+  values[1] = static_cast<float>(xu[1]);
+  values[2] = static_cast<float>(xu[2]);
+  for (int m = 3; m < m_nfields; ++m)
+    values[m] = static_cast<float>(getAttribute(m - 3, i));
+}
+
+/* ----------------------------------------------------------------------
+   decimation map of the preview by vertex clustering on the mesh graph:
+   vertices are visited in index order, an unclustered vertex is retained and
+   takes all unclustered vertices within m_previewRings edges, faces are mapped
+   to retained vertices and degenerate and duplicate faces are dropped.
+   Retained tags are sent to all procs, so preview frames gather only them.
+------------------------------------------------------------------------- */
 
-      // write vertices
-      Point* pPoints = reinterpret_cast<Point*>( &positions[0] );
-      std::sort(pPoints, pPoints + positions.size() / 4);
-      for (size_t i = 0; i < positions.size() / 4; ++i) {
-        file << "v " << std::fixed << pPoints[i].x << " " << pPoints[i].y << " " << pPoints[i].z << std::endl;
+void FixDumpMesh::buildPreview()
+{
+  std::vector<int> previewFaces;
+  int nretained = 0;
+  if (comm->me == 0) {
+    const std::vector<int>& table = m_parallelWriter ? m_globalTags2VertInd : m_tags2VertInd;
+    tagint minTag = m_parallelWriter ? m_globalMinTag : m_minTag;
+    int nvertices = m_nglobalParticles;
+    std::vector<tagint> vertexTags(nvertices);
+    for (size_t t = 0; t < table.size(); ++t) {
+      if (table[t] >= 0)
+        vertexTags[table[t]] = minTag + t;
+    }
+
+    // adjacency of the mesh graph in compressed rows
+    std::vector<int> rowStarts(nvertices + 1, 0), neighbors(2 * m_faces.size());
+    for (size_t f = 0; f < m_faces.size(); ++f)
+      rowStarts[m_faces[f] + 1] += 2;
+    for (int v = 0; v < nvertices; ++v)
+      rowStarts[v + 1] += rowStarts[v];
+    std::vector<int> fill(rowStarts.begin(), rowStarts.end() - 1);
+    for (size_t f = 0; f < m_faces.size(); f += 3) {
+      for (int c = 0; c < 3; ++c) {
+        int v = m_faces[f + c];
+        neighbors[fill[v]++] = m_faces[f + (c + 1) % 3];
+        neighbors[fill[v]++] = m_faces[f + (c + 2) % 3];
       }
+    }
 
-      // write triangles
-      for (std::vector<int>::const_iterator it = m_triangulation.begin(); it != m_triangulation.end(); it += 3) {
-        // Skip triangles which intersect domain borders
-        int vi[] = {get(m_tags2VertInd, *(it)), get(m_tags2VertInd, *(it + 1)), get(m_tags2VertInd, *(it + 2))};
-        float bma[3] = {pPoints[vi[0]].x - pPoints[vi[1]].x, pPoints[vi[0]].y - pPoints[vi[1]].y, pPoints[vi[0]].z - pPoints[vi[1]].z};
-        float cma[3] = {pPoints[vi[1]].x - pPoints[vi[2]].x, pPoints[vi[1]].y - pPoints[vi[2]].y, pPoints[vi[1]].z - pPoints[vi[2]].z};
-        float area = 0.5 * ((bma[1]*cma[2] - bma[2]*cma[1])*(bma[1]*cma[2] - bma[2]*cma[1]) +
-                            (bma[2]*cma[0] - bma[0]*cma[2])*(bma[2]*cma[0] - bma[0]*cma[2]) +
-                            (cma[0]*bma[1] - bma[0]*cma[1])*(cma[0]*bma[1] - bma[0]*cma[1]));
-        if (area < m_maxArea) {
-          file << "f " << vi[0] + 1 << " " << vi[1] + 1 << " " << vi[2] + 1 << std::endl;
+    // breadth first search limited by rings from every new representative
+    std::vector<int> cluster(nvertices, -1);
+    std::vector<int> front, next;
+    m_previewTags.clear();
+    for (int v = 0; v < nvertices; ++v) {
+      if (cluster[v] >= 0)
+        continue;
+      cluster[v] = v;
+      m_previewTags.push_back(vertexTags[v]);
+      front.assign(1, v);
+      for (int ring = 0; ring < m_previewRings && !front.empty(); ++ring) {
+        next.clear();
+        for (size_t k = 0; k < front.size(); ++k) {
+          for (int n = rowStarts[front[k]]; n < rowStarts[front[k] + 1]; ++n) {
+            if (cluster[neighbors[n]] < 0) {
+              cluster[neighbors[n]] = v;
+              next.push_back(neighbors[n]);
+            }
+          }
         }
+        front.swap(next);
       }
     }
+    std::sort(m_previewTags.begin(), m_previewTags.end());
+    nretained = m_previewTags.size();
+
+    // preview vertices are ordered by tag like the full mesh
+    std::set<Face> unique;
+    for (size_t f = 0; f < m_faces.size(); f += 3) {
+      Face face = {{vertexTags[cluster[m_faces[f]]], vertexTags[cluster[m_faces[f + 1]]],
+                    vertexTags[cluster[m_faces[f + 2]]]}};
+      if (face.v[0] == face.v[1] || face.v[1] == face.v[2] || face.v[0] == face.v[2])
+        continue;
+      Face key = face;
+      std::sort(key.v, key.v + 3);
+      if (!unique.insert(key).second)
+        continue;
+      for (int c = 0; c < 3; ++c)
+        previewFaces.push_back(std::lower_bound(m_previewTags.begin(), m_previewTags.end(), face.v[c])
+                               - m_previewTags.begin());
+    }
   }
-  catch(...)
-  {
-    error->all(FLERR, "Internal error");
+
+  MPI_Bcast(&nretained, 1, MPI_INT, 0, world);
+  m_previewTags.resize(nretained);
+  if (nretained)
+    MPI_Bcast(&m_previewTags[0], nretained, MPI_LMP_TAGINT, 0, world);
+  m_previewPositions.resize(comm->me == 0 ? static_cast<size_t>(nretained) * m_nfields : 0);
+
+  if (m_previewWriter) {
+    try
+    {
+      m_previewWriter->setFaces(previewFaces);
+    }
+    catch(std::exception& e)
+    {
+      error->one(FLERR, e.what());
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------
+   gathers retained vertices only, preview frames are written by root
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::writePreview()
+{
+  m_localRecords.clear();
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if ((atom->mask[i] & groupbit) &&
+        std::binary_search(m_previewTags.begin(), m_previewTags.end(), atom->tag[i])) {
+      m_localRecords.resize(m_localRecords.size() + m_recordSize);
+      packRecord(i, &m_localRecords[m_localRecords.size() - m_recordSize]);
+    }
+  }
+  gatherRecords(m_localRecords, m_recordType, world, 0, m_globalRecords);
+
+  if (comm->me == 0) {
+    size_t nrecords = m_globalRecords.size() / m_recordSize;
+    for (size_t r = 0; r < nrecords; ++r) {
+      char* rec = &m_globalRecords[r * m_recordSize];
+      size_t vi = std::lower_bound(m_previewTags.begin(), m_previewTags.end(), recordTag(rec)) - m_previewTags.begin();
+      std::copy(recordValues(rec), recordValues(rec) + m_nfields, &m_previewPositions[vi * m_nfields]);
+    }
+
+    MeshFrame frame;
+    frame.timestep = update->ntimestep;
+    frame.index = update->ntimestep/m_previewEvery;
+    frame.nvertices = m_previewTags.size();
+    frame.stride = m_nfields;
+    frame.data = m_previewPositions.empty() ? 0 : &m_previewPositions[0];
+    for (int c = 0; c < 3; ++c) {
+      frame.boxlo[c] = domain->triclinic ? domain->boxlo_bound[c] : domain->boxlo[c];
+      frame.boxhi[c] = domain->triclinic ? domain->boxhi_bound[c] : domain->boxhi[c];
+    }
+    try
+    {
+      m_previewWriter->write(frame);
+    }
+    catch(std::exception& e)
+    {
+      error->one(FLERR, e.what());
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------
+   invoke computes and evaluate variables used as attributes
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::computeAttributes()
+{
+  if (m_attributeKinds.empty())
+    return;
+
+  modify->clearstep_compute();
+  for (size_t m = 0; m < m_attributeKinds.size(); ++m) {
+    if (m_attributeKinds[m] == COMPUTE) {
+      Compute* compute = modify->compute[m_attributeIndices[m]];
+      if (!(compute->invoked_flag & INVOKED_PERATOM)) {
+        compute->compute_peratom();
+        compute->invoked_flag |= INVOKED_PERATOM;
+      }
+    } else if (m_attributeKinds[m] == VARIABLE) {
+      m_variableValues[m].resize(atom->nmax);
+      input->variable->compute_atom(m_attributeIndices[m], igroup, &m_variableValues[m][0], 1, 0);
+    }
+  }
+  modify->addstep_compute(update->ntimestep + nevery);
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixDumpMesh::getAttribute(int m, int i) const
+{
+  int column = m_attributeColumns[m];
+  switch (m_attributeKinds[m]) {
+    case VX: return atom->v[i][0];
+    case VY: return atom->v[i][1];
+    case VZ: return atom->v[i][2];
+    case FX: return atom->f[i][0];
+    case FY: return atom->f[i][1];
+    case FZ: return atom->f[i][2];
+    case COMPUTE: {
+      Compute* compute = modify->compute[m_attributeIndices[m]];
+      return column ? compute->array_atom[i][column - 1] : compute->vector_atom[i];
+    }
+    case FIX: {
+      Fix* fix = modify->fix[m_attributeIndices[m]];
+      return column ? fix->array_atom[i][column - 1] : fix->vector_atom[i];
+    }
+    default: return m_variableValues[m][i];
+  }
+}
+
+/* ----------------------------------------------------------------------
+   derived datatype for vertex records [tag, m_nfields floats]
+   extent is padded to keep tags aligned in packed buffers
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::createRecordType()
+{
+  if (m_recordType != MPI_DATATYPE_NULL)
+    MPI_Type_free(&m_recordType);
+
+  m_recordSize = sizeof(tagint) + m_nfields * sizeof(float);
+  m_recordSize = (m_recordSize + sizeof(tagint) - 1) / sizeof(tagint) * sizeof(tagint);
+
+  int blockLengths[2] = {1, m_nfields};
+  MPI_Aint displacements[2] = {0, sizeof(tagint)};
+  MPI_Datatype types[2] = {MPI_LMP_TAGINT, MPI_FLOAT};
+  MPI_Datatype structType;
+  MPI_Type_create_struct(2, blockLengths, displacements, types, &structType);
+  MPI_Type_create_resized(structType, 0, m_recordSize, &m_recordType);
+  MPI_Type_commit(&m_recordType);
+  MPI_Type_free(&structType);
+}
+
+/* ----------------------------------------------------------------------
+   dense table from tags of vertices [firstVertex, firstVertex + N) given in vertex order
+   to their indices relative to firstVertex, allocates vertex data of these vertices
+------------------------------------------------------------------------- */
+
+void FixDumpMesh::buildVertexTable(const std::vector<tagint>& tags, int firstVertex)
+{
+  m_firstVertex = firstVertex;
+  m_tags2VertInd.clear();
+  m_minTag = 0;
+  if (!tags.empty()) {
+    m_minTag = *std::min_element(tags.begin(), tags.end());
+    tagint maxTag = *std::max_element(tags.begin(), tags.end());
+    m_tags2VertInd.assign(maxTag - m_minTag + 1, -1);
+    for (int i = 0; i < (int)tags.size(); ++i) {
+      m_tags2VertInd[tags[i] - m_minTag] = i;
+    }
   }
+  m_positions.resize(tags.size() * m_nfields);
 }
@@ -14,29 +14,145 @@ FixStyle(dump/mesh,FixDumpMesh)
 #include "fix.h"
 #include <string>
 #include <vector>
-#include <unordered_map>
+#include <map>
+
+class MeshWriter;
+class AsyncMeshWriter;
+class ParallelMeshTrajectoryWriter;
 
 namespace LAMMPS_NS {
 
 /**
 * @class
-*   Dumps structure in OBJ geometry format, uses angles for triangulation
+*   Dumps structure in OBJ, binary VTK PolyData, binary PLY or single file trajectory format,
+*   uses angles for triangulation
+*   fix ID group dump/mesh N template [attribute ...] [format obj|vtp|vtp/shared|ply|ply/shared|traj|traj/mpiio] [async Nframes]
+*     [quantize bbox|domain] [delta K] [compress yes|no] [unwrap image|molecule]
+*     [trigger D] [min Nmin] [max Nmax] [partition W] [preview Np R]
+*   attribute = vx, vy, vz, fx, fy, fz, c_ID, c_ID[i], f_ID, f_ID[i], v_name - per-atom values written
+*   for every vertex after its position (extra OBJ vertex columns, VTP point data, PLY properties,
+*   traj vertex floats with names in the attribute record).
+*   Every vtp and ply frame contains its faces, with vtp/shared and ply/shared faces are written
+*   only into template.faces.N.vtp (ply) at frame N after every topology change and frames hold only vertices.
+*   Shared frames alone are point clouds, scripts/mesh_shared_faces.py attaches the faces in ParaView
+*   or joins them into self-contained frames.
+*   With traj/mpiio every proc owns a contiguous range of vertices, records are sent to owners
+*   and every proc writes its slab of the frame, so the mesh is never assembled on one proc.
+*   With async root writes frames in a background thread, at most Nframes are in flight.
+*   With quantize traj positions are stored as 16 bit integers on the grid of the frame bounding box
+*   or of the domain, delta K stores K - 1 frames after every keyframe as differences,
+*   compress uses zlib (requires -DMESH_TRAJECTORY_ZLIB).
+*   Vertices are unwrapped using image flags, so faces crossing periodic boundaries are intact.
+*   With unwrap molecule every molecule is shifted by the image of its vertex with the smallest tag,
+*   so molecules stay in the box.
+*   Topology may change during the run: if the set of vertices changes the mesh is rebuilt,
+*   if only angles change procs send added and removed triangles to root, which updates faces.
+*   Frames of traj formats following a topology record are marked as having new connectivity.
+*   With trigger the condition is checked every N steps and the frame is written only if some vertex
+*   has moved by more than D (unwrapped) since the last written frame. Frames are written not more often
+*   than every Nmin timesteps and at least every Nmax timesteps (if given), the first frame is always written.
+*   With partition (obj only) molecules are split between W writer procs, every writer proc
+*   writes its own file template.part<w>.<frame>.obj with one object per molecule,
+*   vertices are sent directly to their writer. Any topology change rebuilds the partition.
+*   With preview every Np steps root writes a decimated mesh template.lod.<frame>.<ext>:
+*   vertices are clustered within R edges when topology changes and only cluster
+*   representatives are gathered for preview frames.
 */
 class FixDumpMesh : public Fix
 {
+  struct Face
+  {
+    tagint v[3];
+    bool operator< (const Face& right) const
+    {
+      return v[0] < right.v[0] || (v[0] == right.v[0] && (v[1] < right.v[1] || (v[1] == right.v[1] && v[2] < right.v[2])));
+    }
+  };
+  enum Checksums { NVERTICES, VERTICES_HASH, NFACES, FACES_HASH, NCHECKSUMS };
+
   int m_nglobalParticles;
-  const double m_maxArea;
   std::string m_fileNameTemplate;
-  std::unordered_map<int, int> m_tags2VertInd; // mapping from tags to indicies of vertices used for obj
-  std::vector<int> m_triangulation; // triangles indices, linearized, tags
+  std::vector<int> m_faces; // triangles as indices of vertices used for obj, linearized, only on root
+  std::vector<int> m_tags2VertInd; // vertex index of tag m_minTag + i relative to m_firstVertex
+  tagint m_minTag;
+  int m_nfields; // floats per vertex record
+  int m_recordSize; // bytes per vertex record [tag, x, y, z, attributes]
+  MPI_Datatype m_recordType;
+  std::vector<char> m_localRecords;
+  std::vector<char> m_globalRecords;
+  std::vector<float> m_positions; // vertex data of vertices owned by this proc ordered by vertex index
+  std::string m_format;
+  MeshWriter* m_writer; // only on root
+  int m_framesInFlight; // 0 if frames are written synchronously
+  AsyncMeshWriter* m_asyncWriter; // the same object as m_writer if async, only on root
+  ParallelMeshTrajectoryWriter* m_parallelWriter; // traj/mpiio only, on all procs
+  std::vector<tagint> m_splitters; // first tag owned by every proc, traj/mpiio only
+  int m_firstVertex; // first vertex owned by this proc
+  std::vector<int> m_recordOwners;
+  std::vector<int> m_sendCounts;
+  bool m_moleculeUnwrap;
+  class MoleculeCounter* m_moleculeCounter; // unwrap molecule only
+  std::vector<tagint> m_referenceTags; // smallest tag of every molecule
+  std::vector<int> m_localReferenceImages;
+  std::vector<int> m_referenceImages; // image of the reference vertex of every molecule
+  std::vector<Face> m_localFaces; // sorted triangles stored by this proc at the last topology update
+  std::map<Face, int> m_faceCounts; // all triangles with multiplicity, only on root
+  std::vector<int> m_globalTags2VertInd; // whole table to convert faces, traj/mpiio only, only on root
+  tagint m_globalMinTag;
+  unsigned long long m_checksums[NCHECKSUMS]; // topology at the last update
+  enum AttributeKind { VX, VY, VZ, FX, FY, FZ, COMPUTE, FIX, VARIABLE };
+  std::vector<int> m_attributeKinds;
+  std::vector<int> m_attributeColumns; // 0 for per-atom vector, i for column i of per-atom array
+  std::vector<std::string> m_attributeIds; // ID of compute or fix, name of variable
+  std::vector<int> m_attributeIndices; // index of compute, fix or variable, set in init
+  std::vector<std::string> m_attributeNames; // as given in the command
+  std::vector<std::vector<double> > m_variableValues; // per-atom values of variables
+  double m_triggerDistance; // 0 if every N steps is written
+  bigint m_minInterval, m_maxInterval; // 0 if not bounded
+  bigint m_lastDumpStep; // -1 before the first frame
+  double** m_xref; // unwrapped positions at the last written frame, trigger only
+  int m_partitionWriters; // number of writer procs, 0 if the mesh is written by root as one object
+  int m_dumpEvery; // steps between full frames, nevery is the common divisor with preview
+  int m_previewEvery, m_previewRings; // 0 if there is no preview
+  MeshWriter* m_previewWriter; // only on root
+  std::vector<tagint> m_previewTags; // sorted tags of retained vertices
+  std::vector<float> m_previewPositions; // only on root
 public:
   FixDumpMesh(class LAMMPS *, int, char **);
   ~FixDumpMesh();
   int setmask();
+  void init();
   void setup(int);
   void end_of_step();
+  void post_run();
+  double memory_usage();
+  void grow_arrays(int);
+  void copy_arrays(int, int, int);
+  void set_arrays(int);
+  int pack_exchange(int, double*);
+  int unpack_exchange(int, double*);
 private:
-  void writeObj(const std::string& fileName, std::vector<float>& positions);
+  void createRecordType();
+  void buildVertexTable(const std::vector<tagint>& tags, int firstVertex);
+  void buildMesh();
+  void buildPartition();
+  int getPartitionOwner(int imol) const;
+  void buildPreview();
+  void writePreview();
+  void packRecord(int i, char* record) const;
+  void collectLocalFaces(std::vector<Face>& faces) const;
+  void computeChecksums(unsigned long long* checksums) const;
+  void updateFaces();
+  void applyFaceChanges(const std::vector<tagint>& added, const std::vector<tagint>& removed);
+  void publishFaces();
+  void checkWriterError();
+  void findReferenceTags();
+  void updateReferenceImages();
+  void unwrap(int i, double* xu) const;
+  void computeAttributes();
+  double getAttribute(int m, int i) const;
+  bool isTriggered();
+  void storeReferencePositions();
 };
 
 }
@@ -0,0 +1,243 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "fix_mesh_shape.h"
+#include "atom.h"
+#include "comm.h"
+#include "domain.h"
+#include "error.h"
+#include "force.h"
+#include "neighbor.h"
+#include "update.h"
+#include "math_extra.h"
+#include "../utils/AngleList.h"
+#include "../utils/molecule_counter.h"
+#include <algorithm>
+
+using namespace LAMMPS_NS;
+
+namespace {
+  // sums per molecule: area, volume, number of vertices, first and second moments of vertices
+  enum Sums { AREA, VOLUME, COUNT, SX, SY, SZ, SXX, SYY, SZZ, SXY, SXZ, SYZ, NSUMS };
+  enum Columns { C_AREA, C_VOLUME, C_REDUCED_VOLUME, C_XC, C_YC, C_ZC, C_RG2, C_ASPHERICITY, NCOLUMNS };
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixMeshShape::FixMeshShape(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), m_moleculeCounter(0), m_nmolecules(0)
+{
+  if (narg < 4) error->all(FLERR,"Illegal fix mesh/shape command");
+  if (!atom->molecular) error->all(FLERR,"Fix mesh/shape requires molecular system");
+
+  nevery = atoi(arg[3]);
+  if (nevery <= 0) error->all(FLERR,"Illegal fix mesh/shape command: nevery must be positive integer");
+
+  int iarg = 4;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "file") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR,"Illegal fix mesh/shape command");
+      m_fileName = std::string(arg[iarg + 1]);
+      iarg += 2;
+    } else error->all(FLERR,"Illegal fix mesh/shape command");
+  }
+
+  if (comm->me == 0 && !m_fileName.empty()) {
+    m_file.open(m_fileName.c_str());
+    if (!m_file.is_open()) error->one(FLERR,"Cannot open fix mesh/shape file");
+    m_file << "# timestep molecule_index area volume reduced_volume xc yc zc rg2 asphericity" << std::endl;
+  }
+
+  m_moleculeCounter = new MoleculeCounter(lmp);
+  m_moleculeCounter->run(groupbit);
+  m_nmolecules = m_moleculeCounter->getMolNum();
+
+  array_flag = 1;
+  size_array_rows = m_nmolecules;
+  size_array_cols = NCOLUMNS;
+  global_freq = nevery;
+  extarray = 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixMeshShape::~FixMeshShape()
+{
+  delete m_moleculeCounter;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixMeshShape::setmask()
+{
+  int mask = 0;
+  mask |= FixConst::END_OF_STEP;
+  return mask;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixMeshShape::setup(int)
+{
+  m_moleculeCounter->run(groupbit);
+  m_nmolecules = m_moleculeCounter->getMolNum();
+  size_array_rows = m_nmolecules;
+  computeShapes();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixMeshShape::end_of_step()
+{
+  computeShapes();
+  writeShapes();
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixMeshShape::compute_array(int i, int j)
+{
+  if (i < 0 || i >= m_nmolecules) return 0.0;
+  return m_shapes[i * NCOLUMNS + j];
+}
+
+/* ----------------------------------------------------------------------
+   triangles and vertices are taken in unwrapped coordinates, so molecules
+   crossing periodic boundaries are closed surfaces
+------------------------------------------------------------------------- */
+
+void FixMeshShape::computeShapes()
+{
+  m_localSums.assign(static_cast<size_t>(m_nmolecules) * NSUMS, 0.0);
+
+  int nlocal = atom->nlocal;
+  int* mask = atom->mask;
+  double** x = atom->x;
+
+  // with newton_bond off every proc owning an atom of the angle has it in the list
+  bool newtonBond = force->newton_bond;
+  AngleList angleList(neighbor->nanglelist, neighbor->anglelist);
+  for (AngleList::Iterator it = angleList.begin(); it != angleList.end(); ++it) {
+    int vi[3];
+    it.getTriangle(vi);
+    if (!(mask[vi[0]] & mask[vi[1]] & mask[vi[2]] & groupbit))
+      continue;
+
+    int nlocalVertices = (vi[0] < nlocal) + (vi[1] < nlocal) + (vi[2] < nlocal);
+    int owner = vi[0] < nlocal ? vi[0] : (vi[1] < nlocal ? vi[1] : vi[2]);
+    if (atom->molecule[owner] == 0)
+      continue;
+    int imol = m_moleculeCounter->getMolIDbyAtom(owner);
+    if (imol < 0)
+      continue;
+    double weight = newtonBond ? 1.0 : nlocalVertices / 3.0;
+
+    // unwrap the owned vertex and put the others next to it
+    double p[3][3];
+    double origin[3];
+    domain->unmap(x[owner], atom->image[owner], origin);
+    for (int k = 0; k < 3; ++k) {
+      double delta[3];
+      MathExtra::sub3(x[vi[k]], x[owner], delta);
+      domain->minimum_image(delta);
+      MathExtra::add3(origin, delta, p[k]);
+    }
+
+    double ba[3], ca[3], normal[3], bc[3];
+    MathExtra::sub3(p[1], p[0], ba);
+    MathExtra::sub3(p[2], p[0], ca);
+    MathExtra::cross3(ba, ca, normal);
+    MathExtra::cross3(p[1], p[2], bc);
+
+    double* sums = &m_localSums[imol * NSUMS];
+    sums[AREA] += weight * 0.5 * MathExtra::len3(normal);
+    sums[VOLUME] += weight * MathExtra::dot3(p[0], bc) / 6.0; // divergence theorem
+  }
+
+  for (int i = 0; i < nlocal; ++i) {
+    if (!(mask[i] & groupbit) || atom->molecule[i] == 0)
+      continue;
+    int imol = m_moleculeCounter->getMolIDbyAtom(i);
+    if (imol < 0)
+      continue;
+    double xu[3];
+    domain->unmap(x[i], atom->image[i], xu);
+    double* sums = &m_localSums[imol * NSUMS];
+    sums[COUNT] += 1.0;
+    sums[SX] += xu[0];
+    sums[SY] += xu[1];
+    sums[SZ] += xu[2];
+    sums[SXX] += xu[0] * xu[0];
+    sums[SYY] += xu[1] * xu[1];
+    sums[SZZ] += xu[2] * xu[2];
+    sums[SXY] += xu[0] * xu[1];
+    sums[SXZ] += xu[0] * xu[2];
+    sums[SYZ] += xu[1] * xu[2];
+  }
+
+  m_globalSums.resize(m_localSums.size());
+  if (!m_localSums.empty())
+    MPI_Allreduce(&m_localSums[0], &m_globalSums[0], m_localSums.size(), MPI_DOUBLE, MPI_SUM, world);
+
+  m_shapes.assign(static_cast<size_t>(m_nmolecules) * NCOLUMNS, 0.0);
+  for (int imol = 0; imol < m_nmolecules; ++imol) {
+    const double* sums = &m_globalSums[imol * NSUMS];
+    double* shape = &m_shapes[imol * NCOLUMNS];
+    double area = sums[AREA];
+    double volume = sums[VOLUME];
+    shape[C_AREA] = area;
+    shape[C_VOLUME] = volume;
+    // volume relative to the sphere of the same area
+    shape[C_REDUCED_VOLUME] = area > 0.0 ? 6.0 * sqrt(M_PI) * volume / pow(area, 1.5) : 0.0;
+
+    double count = sums[COUNT];
+    if (count == 0.0)
+      continue;
+    double c[3] = {sums[SX] / count, sums[SY] / count, sums[SZ] / count};
+    shape[C_XC] = c[0];
+    shape[C_YC] = c[1];
+    shape[C_ZC] = c[2];
+
+    double gyration[3][3];
+    gyration[0][0] = sums[SXX] / count - c[0] * c[0];
+    gyration[1][1] = sums[SYY] / count - c[1] * c[1];
+    gyration[2][2] = sums[SZZ] / count - c[2] * c[2];
+    gyration[0][1] = gyration[1][0] = sums[SXY] / count - c[0] * c[1];
+    gyration[0][2] = gyration[2][0] = sums[SXZ] / count - c[0] * c[2];
+    gyration[1][2] = gyration[2][1] = sums[SYZ] / count - c[1] * c[2];
+    double rg2 = gyration[0][0] + gyration[1][1] + gyration[2][2];
+    shape[C_RG2] = rg2;
+
+    double evalues[3], evectors[3][3];
+    if (rg2 > 0.0 && MathExtra::jacobi(gyration, evalues, evectors) == 0) {
+      double d01 = evalues[0] - evalues[1], d12 = evalues[1] - evalues[2], d02 = evalues[0] - evalues[2];
+      shape[C_ASPHERICITY] = (d01 * d01 + d12 * d12 + d02 * d02) / (2.0 * rg2 * rg2);
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixMeshShape::writeShapes()
+{
+  if (!m_file.is_open())
+    return;
+  for (int imol = 0; imol < m_nmolecules; ++imol) {
+    m_file << update->ntimestep << " " << imol + 1;
+    for (int j = 0; j < NCOLUMNS; ++j)
+      m_file << " " << m_shapes[imol * NCOLUMNS + j];
+    m_file << "\n";
+  }
+  m_file.flush();
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixMeshShape::memory_usage()
+{
+  return (m_localSums.capacity() + m_globalSums.capacity() + m_shapes.capacity()) * sizeof(double);
+}
@@ -0,0 +1,56 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifdef FIX_CLASS
+
+FixStyle(mesh/shape,FixMeshShape)
+
+#else
+
+#ifndef LMP_FIX_MESH_SHAPE_H
+#define LMP_FIX_MESH_SHAPE_H
+
+#include "fix.h"
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace LAMMPS_NS {
+
+/**
+* @class
+*   Computes shape of every molecule of the group represented by a closed triangulated surface,
+*   angles are used as triangles like in dump/mesh.
+*   fix ID group mesh/shape N [file name]
+*   Global array has one row per molecule with columns
+*   area, volume, reduced volume, centroid x, y, z, squared radius of gyration, asphericity.
+*   Triangles are evaluated by procs which have them in the angle list, sums of all molecules
+*   are reduced with one collective.
+*/
+class FixMeshShape : public Fix
+{
+  class MoleculeCounter* m_moleculeCounter;
+  int m_nmolecules;
+  std::vector<double> m_localSums; // sums per molecule, see computeShapes
+  std::vector<double> m_globalSums;
+  std::vector<double> m_shapes; // columns per molecule
+  std::string m_fileName;
+  std::ofstream m_file; // only on root
+public:
+  FixMeshShape(class LAMMPS *, int, char **);
+  ~FixMeshShape();
+  int setmask();
+  void setup(int);
+  void end_of_step();
+  double compute_array(int, int);
+  double memory_usage();
+private:
+  void computeShapes();
+  void writeShapes();
+};
+
+}
+
+#endif
+#endif
@@ -0,0 +1,153 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "stdlib.h"
+#include "string.h"
+#include "fix_sample_spatial.h"
+#include "fix_ave_spatial.h"
+#include "atom.h"
+#include "error.h"
+#include "memory.h"
+#include "modify.h"
+#include <algorithm>
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+FixSampleSpatial::FixSampleSpatial(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), m_aveSpatial(0), m_nvalues(0), m_values(0)
+{
+  if (narg != 5) error->all(FLERR,"Illegal fix sample/spatial command");
+
+  nevery = atoi(arg[3]);
+  if (nevery <= 0) error->all(FLERR,"Illegal fix sample/spatial command: nevery must be positive integer");
+
+  m_aveSpatialId = std::string(arg[4]);
+  int ifix = modify->find_fix(arg[4]);
+  if (ifix < 0) error->all(FLERR,"Fix ID for fix sample/spatial does not exist");
+  if (strcmp(modify->fix[ifix]->style, "ave/spatial") != 0)
+    error->all(FLERR,"Fix sample/spatial requires fix ave/spatial");
+  m_aveSpatial = static_cast<FixAveSpatial*>(modify->fix[ifix]);
+  m_nvalues = m_aveSpatial->get_nvalues();
+
+  peratom_flag = 1;
+  size_peratom_cols = m_nvalues == 1 ? 0 : m_nvalues;
+  peratom_freq = nevery;
+
+  // sampled values migrate with atoms, atoms not in the group keep zeros
+  grow_arrays(atom->nmax);
+  atom->add_callback(0);
+  for (int i = 0; i < atom->nlocal; ++i)
+    std::fill(m_values[i], m_values[i] + m_nvalues, 0.0);
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixSampleSpatial::~FixSampleSpatial()
+{
+  atom->delete_callback(id, 0);
+  memory->destroy(m_values);
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixSampleSpatial::setmask()
+{
+  int mask = 0;
+  mask |= FixConst::END_OF_STEP;
+  return mask;
+}
+
+/* ----------------------------------------------------------------------
+   fixes are invoked in the order of definition, so fix ave/spatial
+   has its averages ready when this fix samples them
+------------------------------------------------------------------------- */
+
+void FixSampleSpatial::init()
+{
+  int ifix = modify->find_fix(const_cast<char*>(m_aveSpatialId.c_str()));
+  if (ifix < 0) error->all(FLERR,"Fix ID for fix sample/spatial does not exist");
+  m_aveSpatial = static_cast<FixAveSpatial*>(modify->fix[ifix]);
+  if (ifix > modify->find_fix(id))
+    error->all(FLERR,"Fix sample/spatial must be defined after its fix ave/spatial");
+  if (nevery % m_aveSpatial->global_freq)
+    error->all(FLERR,"Fix ave/spatial for fix sample/spatial not computed at compatible time");
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixSampleSpatial::setup(int)
+{
+  sample();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixSampleSpatial::end_of_step()
+{
+  sample();
+}
+
+/* ----------------------------------------------------------------------
+   every proc interpolates at its own atoms, grid is the same on all procs
+------------------------------------------------------------------------- */
+
+void FixSampleSpatial::sample()
+{
+  for (int i = 0; i < atom->nlocal; ++i) {
+    if (!(atom->mask[i] & groupbit) || !m_aveSpatial->interpolate(atom->x[i], m_values[i]))
+      std::fill(m_values[i], m_values[i] + m_nvalues, 0.0);
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+double FixSampleSpatial::memory_usage()
+{
+  return atom->nmax * m_nvalues * sizeof(double);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixSampleSpatial::grow_arrays(int nmax)
+{
+  memory->grow(m_values, nmax, m_nvalues, "sample/spatial:values");
+  updatePointers();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixSampleSpatial::copy_arrays(int i, int j, int)
+{
+  std::copy(m_values[i], m_values[i] + m_nvalues, m_values[j]);
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixSampleSpatial::pack_exchange(int i, double* buf)
+{
+  std::copy(m_values[i], m_values[i] + m_nvalues, buf);
+  return m_nvalues;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixSampleSpatial::unpack_exchange(int nlocal, double* buf)
+{
+  std::copy(buf, buf + m_nvalues, m_values[nlocal]);
+  return m_nvalues;
+}
+
+/* ----------------------------------------------------------------------
+   per-atom vector is the first column of the array
+------------------------------------------------------------------------- */
+
+void FixSampleSpatial::updatePointers()
+{
+  if (m_nvalues == 1)
+    vector_atom = m_values ? m_values[0] : 0;
+  else
+    array_atom = m_values;
+}
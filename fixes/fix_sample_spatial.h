@@ -0,0 +1,58 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifdef FIX_CLASS
+
+FixStyle(sample/spatial,FixSampleSpatial)
+
+#else
+
+#ifndef LMP_FIX_SAMPLE_SPATIAL_H
+#define LMP_FIX_SAMPLE_SPATIAL_H
+
+#include "fix.h"
+#include <string>
+
+namespace LAMMPS_NS {
+
+/**
+* @class
+*   Interpolates values averaged by fix ave/spatial to atoms of the group, for instance
+*   fluid velocity at membrane vertices.
+*   fix ID group sample/spatial N aveSpatialID
+*   Every N steps values of the grid are interpolated multilinearly between bin centers
+*   at positions of local atoms of the group, N must be a multiple of Nfreq of fix ave/spatial
+*   and fix ave/spatial must be defined before this fix. Interpolation wraps across a periodic
+*   boundary only if bins tile the box exactly (origin lower, box length multiple of delta),
+*   otherwise values are constant beyond outer bin centers.
+*   Result is a per-atom vector (one value) or array (one column per value of fix ave/spatial),
+*   it can be used as f_ID[i] in dump/mesh or dump custom. Atoms not in the group have zeros.
+*/
+class FixSampleSpatial : public Fix
+{
+  std::string m_aveSpatialId;
+  class FixAveSpatial* m_aveSpatial;
+  int m_nvalues;
+  double** m_values; // per-atom values, migrate with atoms
+public:
+  FixSampleSpatial(class LAMMPS *, int, char **);
+  ~FixSampleSpatial();
+  int setmask();
+  void init();
+  void setup(int);
+  void end_of_step();
+  double memory_usage();
+  void grow_arrays(int);
+  void copy_arrays(int, int, int);
+  int pack_exchange(int, double*);
+  int unpack_exchange(int, double*);
+private:
+  void sample();
+  void updatePointers();
+};
+
+}
+
+#endif
+#endif
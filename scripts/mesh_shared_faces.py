@@ -0,0 +1,146 @@
+#!/usr/bin/env python
+
+'''
+Attaches faces written by fix dump/mesh with format vtp/shared or ply/shared to the frames.
+Frames template.I.vtp (ply) hold only vertices, faces are in template.faces.N.vtp (ply) and
+are used by all frames from N on until the next faces file.
+
+Two modes:
+1. view (vtp/shared only), run from pvpython or ParaView Python Shell:
+     pvpython mesh_shared_faces.py template
+   opens template.pvd and adds a Programmable Filter which attaches the faces of every time step.
+2. join, plain python:
+     python mesh_shared_faces.py template --join output [--format ply]
+   writes self-contained frames output.I.vtp (ply) and output.pvd for vtp.
+
+@author: kirill lykov
+'''
+import os
+import re
+import glob
+import argparse
+
+# frame index -> file name, for files template.I.extension
+def getIndexedFiles(template, extension):
+    pattern = re.compile(re.escape(os.path.basename(template)) + r'\.(\d+)\.' + extension + '$')
+    files = {}
+    for fileName in glob.glob(template + '.*.' + extension):
+        match = pattern.match(os.path.basename(fileName))
+        if match:
+            files[int(match.group(1))] = fileName
+    return files
+
+# for every frame the faces file with the largest index not greater than the frame index
+def getFacesOfFrames(template, extension):
+    frames = getIndexedFiles(template, extension)
+    faces = getIndexedFiles(template + '.faces', extension)
+    result = []
+    for index in sorted(frames):
+        starts = [n for n in faces if n <= index]
+        if not starts:
+            raise RuntimeError('no faces file for frame ' + frames[index])
+        result.append((index, frames[index], faces[max(starts)]))
+    return result
+
+# timestep -> frame file name from the pvd collection
+def getTimesteps(pvdName):
+    timesteps = {}
+    directory = os.path.dirname(pvdName)
+    for match in re.finditer(r'timestep="([^"]*)"\s+file="([^"]*)"', open(pvdName).read()):
+        timesteps[float(match.group(1))] = os.path.join(directory, match.group(2))
+    return timesteps
+
+# script of the Programmable Filter, facesOfFiles maps frame file name to faces file name
+filterScript = '''
+from vtkmodules.vtkIOXML import vtkXMLPolyDataReader
+from vtkmodules.vtkCommonExecutionModel import vtkStreamingDemandDrivenPipeline
+facesOfFiles = %r
+timesteps = %r
+outInfo = self.GetOutputInformation(0)
+time = outInfo.Get(vtkStreamingDemandDrivenPipeline.UPDATE_TIME_STEP()) if outInfo.Has(vtkStreamingDemandDrivenPipeline.UPDATE_TIME_STEP()) else min(timesteps)
+time = max([t for t in timesteps if t <= time] or [min(timesteps)])
+reader = vtkXMLPolyDataReader()
+reader.SetFileName(facesOfFiles[timesteps[time]])
+reader.Update()
+output.ShallowCopy(self.GetInputDataObject(0, 0))
+output.SetPolys(reader.GetOutput().GetPolys())
+'''
+
+def view(template):
+    from paraview import simple
+    pvdName = template + '.pvd'
+    facesOfFiles = dict((os.path.abspath(frame), os.path.abspath(faces))
+                        for index, frame, faces in getFacesOfFrames(template, 'vtp'))
+    timesteps = dict((t, os.path.abspath(f)) for t, f in getTimesteps(pvdName).items())
+    frames = simple.PVDReader(FileName=pvdName)
+    mesh = simple.ProgrammableFilter(Input=frames)
+    mesh.OutputDataSetType = 'vtkPolyData'
+    mesh.Script = filterScript % (facesOfFiles, timesteps)
+    simple.Show(mesh)
+    simple.Render()
+    return mesh
+
+# frame and faces files are split into the text header and the binary data
+def splitVtp(fileName):
+    content = open(fileName, 'rb').read()
+    begin = content.index(b'<AppendedData encoding="raw">\n   _') + len(b'<AppendedData encoding="raw">\n   _')
+    end = content.rindex(b'\n  </AppendedData>')
+    return content[:begin], content[begin:end], content[end:]
+
+def joinVtp(frameName, facesName):
+    header, data, tail = splitVtp(frameName)
+    facesHeader, facesData, facesTail = splitVtp(facesName)
+    polys = re.search(b'      <Polys>.*</Polys>\n', facesHeader, re.S).group(0)
+    connectivityOffset = int(re.search(b'Name="connectivity" format="appended" offset="(\\d+)"', polys).group(1))
+    # polys are the last blocks of the faces file, shift them behind the frame data
+    shift = len(data) - connectivityOffset
+    polys = re.sub(b'offset="(\\d+)"', lambda m: b'offset="' + str(int(m.group(1)) + shift).encode() + b'"', polys)
+    npolys = re.search(b'NumberOfPolys="\\d+"', facesHeader).group(0)
+    header = re.sub(b'NumberOfPolys="\\d+"', npolys, header)
+    header = header.replace(b'    </Piece>', polys + b'    </Piece>', 1)
+    return header + data + facesData[connectivityOffset:] + tail
+
+def splitPly(fileName):
+    content = open(fileName, 'rb').read()
+    end = content.index(b'end_header\n')
+    header = content[:end]
+    nvertices = int(re.search(b'element vertex (\\d+)', header).group(1))
+    nproperties = len(re.findall(b'property float', header))
+    vertexBytes = nvertices * nproperties * 4
+    return header, content[end:end + len(b'end_header\n') + vertexBytes], content[end + len(b'end_header\n') + vertexBytes:]
+
+def joinPly(frameName, facesName):
+    header, vertices, faces = splitPly(frameName)
+    facesHeader, facesVertices, facesBlock = splitPly(facesName)
+    element = re.search(b'element face.*', facesHeader, re.S).group(0)
+    return header + element + vertices + facesBlock
+
+# writes self-contained output.I.extension, no vtk is required
+def join(template, extension, output):
+    joinFrame = joinVtp if extension == 'vtp' else joinPly
+    timesteps = {}
+    if extension == 'vtp':
+        timesteps = dict((os.path.abspath(f), t) for t, f in getTimesteps(template + '.pvd').items())
+        pvd = open(output + '.pvd', 'w')
+        pvd.write('<?xml version="1.0"?>\n<VTKFile type="Collection" version="0.1">\n  <Collection>\n')
+    for index, frame, faces in getFacesOfFrames(template, extension):
+        outName = '%s.%d.%s' % (output, index, extension)
+        open(outName, 'wb').write(joinFrame(frame, faces))
+        if extension == 'vtp':
+            pvd.write('    <DataSet timestep="%d" file="%s"/>\n'
+                      % (timesteps[os.path.abspath(frame)], os.path.basename(outName)))
+    if extension == 'vtp':
+        pvd.write('  </Collection>\n</VTKFile>\n')
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Attaches shared faces of fix dump/mesh to frames')
+    parser.add_argument('template', help='file name template of fix dump/mesh')
+    parser.add_argument('--join', metavar='output', help='write self-contained frames output.I.vtp (ply)')
+    parser.add_argument('--format', default='vtp', choices=['vtp', 'ply'], help='format of frames, ply only with --join')
+    args = parser.parse_args()
+    if args.join:
+        join(args.template, args.format, args.join)
+    else:
+        if args.format != 'vtp':
+            parser.error('only vtp frames can be viewed, use --join for ply')
+        view(args.template)
@@ -0,0 +1,143 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "async_mesh_writer.h"
+#include <stdexcept>
+
+AsyncMeshWriter::AsyncMeshWriter(MeshWriter* writer, int maxFramesInFlight)
+: MeshWriter(""), m_writer(writer), m_maxFramesInFlight(maxFramesInFlight > 0 ? maxFramesInFlight : 1),
+  m_busy(false), m_stop(false), m_failed(false)
+{
+  pthread_mutex_init(&m_mutex, 0);
+  pthread_cond_init(&m_changed, 0);
+  if (pthread_create(&m_thread, 0, &AsyncMeshWriter::run, this) != 0) {
+    pthread_cond_destroy(&m_changed);
+    pthread_mutex_destroy(&m_mutex);
+    throw std::runtime_error("could not start writer thread");
+  }
+}
+
+AsyncMeshWriter::~AsyncMeshWriter()
+{
+  pthread_mutex_lock(&m_mutex);
+  m_stop = true;
+  pthread_cond_broadcast(&m_changed);
+  pthread_mutex_unlock(&m_mutex);
+  pthread_join(m_thread, 0);
+
+  pthread_cond_destroy(&m_changed);
+  pthread_mutex_destroy(&m_mutex);
+  delete m_writer;
+}
+
+void* AsyncMeshWriter::run(void* self)
+{
+  static_cast<AsyncMeshWriter*>(self)->loop();
+  return 0;
+}
+
+void AsyncMeshWriter::loop()
+{
+  pthread_mutex_lock(&m_mutex);
+  while (true) {
+    while (m_queue.empty() && !m_stop)
+      pthread_cond_wait(&m_changed, &m_mutex);
+    if (m_queue.empty())
+      break; // stopped and drained
+
+    Job job;
+    job.frame = m_queue.front().frame;
+    job.data.swap(m_queue.front().data);
+    m_queue.pop_front();
+    m_busy = true;
+    bool skip = m_failed; // frames after the first error are dropped
+    pthread_mutex_unlock(&m_mutex);
+
+    std::string error;
+    if (!skip) {
+      try
+      {
+        job.frame.data = job.data.empty() ? 0 : &job.data[0];
+        m_writer->write(job.frame);
+      }
+      catch(std::exception& e)
+      {
+        error = e.what();
+      }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    if (!error.empty() && !m_failed) {
+      m_failed = true;
+      m_error = error;
+    }
+    m_freeBuffers.push_back(std::vector<float>());
+    m_freeBuffers.back().swap(job.data);
+    m_busy = false;
+    pthread_cond_broadcast(&m_changed);
+  }
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void AsyncMeshWriter::setFaces(const std::vector<int>& faces)
+{
+  // queued frames must be written with the old faces
+  drain();
+  m_writer->setFaces(faces);
+}
+
+void AsyncMeshWriter::setAttributeNames(const std::vector<std::string>& names)
+{
+  drain();
+  m_writer->setAttributeNames(names);
+}
+
+void AsyncMeshWriter::setObjects(const std::vector<MeshObject>& objects)
+{
+  drain();
+  m_writer->setObjects(objects);
+}
+
+void AsyncMeshWriter::write(const MeshFrame& frame)
+{
+  std::vector<float> data(frame.data, frame.data + static_cast<size_t>(frame.nvertices) * frame.stride);
+  submit(frame, data);
+}
+
+void AsyncMeshWriter::submit(const MeshFrame& frame, std::vector<float>& data)
+{
+  pthread_mutex_lock(&m_mutex);
+  while (m_queue.size() + (m_busy ? 1 : 0) >= m_maxFramesInFlight && !m_failed)
+    pthread_cond_wait(&m_changed, &m_mutex);
+
+  size_t size = data.size();
+  m_queue.push_back(Job());
+  m_queue.back().frame = frame;
+  m_queue.back().data.swap(data);
+  if (!m_freeBuffers.empty()) {
+    data.swap(m_freeBuffers.back());
+    m_freeBuffers.pop_back();
+  }
+  data.resize(size);
+
+  pthread_cond_broadcast(&m_changed);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void AsyncMeshWriter::drain()
+{
+  pthread_mutex_lock(&m_mutex);
+  while (!m_queue.empty() || m_busy)
+    pthread_cond_wait(&m_changed, &m_mutex);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+bool AsyncMeshWriter::getError(std::string& message)
+{
+  pthread_mutex_lock(&m_mutex);
+  bool failed = m_failed;
+  message = m_error;
+  pthread_mutex_unlock(&m_mutex);
+  return failed;
+}
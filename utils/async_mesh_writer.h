@@ -0,0 +1,89 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef ASYNC_MESH_WRITER_H_
+#define ASYNC_MESH_WRITER_H_
+
+#include "mesh_writer.h"
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * @class
+ *  Writes frames of another MeshWriter in a background thread.
+ *  At most maxFramesInFlight frames are queued or being written, submitting one more blocks.
+ *  Errors of the background thread are not thrown, they are reported by getError.
+ *  Example:
+ *    AsyncMeshWriter writer(createMeshWriter("obj", "mesh"), 2);
+ *    writer.submit(frame, positions); // positions is swapped with a recycled buffer
+ *    writer.drain();
+ *    if (writer.getError(message)) ...
+ */
+class AsyncMeshWriter : public MeshWriter
+{
+  struct Job
+  {
+    MeshFrame frame;
+    std::vector<float> data;
+  };
+
+  MeshWriter* m_writer;
+  size_t m_maxFramesInFlight;
+  std::deque<Job> m_queue;
+  std::vector< std::vector<float> > m_freeBuffers;
+  bool m_busy; // background thread is writing a frame
+  bool m_stop;
+  bool m_failed;
+  std::string m_error;
+  pthread_t m_thread;
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_changed;
+public:
+  /**
+   * @param writer
+   *  writer used by the background thread, owned by this object
+   */
+  AsyncMeshWriter(MeshWriter* writer, int maxFramesInFlight);
+
+  /**
+   * Writes all queued frames
+   */
+  ~AsyncMeshWriter();
+
+  void setFaces(const std::vector<int>& faces);
+
+  void setAttributeNames(const std::vector<std::string>& names);
+
+  void setObjects(const std::vector<MeshObject>& objects);
+
+  /**
+   * Copies frame data into the queue
+   */
+  void write(const MeshFrame& frame);
+
+  /**
+   * Moves data into the queue without copy, data is replaced by a recycled buffer of the same size.
+   * frame.data is ignored.
+   */
+  void submit(const MeshFrame& frame, std::vector<float>& data);
+
+  /**
+   * Blocks until all queued frames are written
+   */
+  void drain();
+
+  /**
+   * @return
+   *  true if writing of some frame failed, message is set to the first error
+   */
+  bool getError(std::string& message);
+
+private:
+  static void* run(void* self);
+  void loop();
+};
+
+#endif /* ASYNC_MESH_WRITER_H_ */
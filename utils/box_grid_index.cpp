@@ -0,0 +1,111 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "box_grid_index.h"
+#include <algorithm>
+#include <math.h>
+
+namespace
+{
+  const int maxCellsPerDim = 256;
+}
+
+BoxGridIndex::BoxGridIndex()
+{
+  for (int d = 0; d < 3; ++d) {
+    m_lo[d] = 0.0;
+    m_cellSize[d] = 1.0;
+    m_ncells[d] = 0;
+  }
+}
+
+void BoxGridIndex::build(const std::vector<BoundingBox>& boxes, const double* lo, const double* hi)
+{
+  // boxes clipped by the domain
+  std::vector<int> boxIds;
+  double meanSize[3] = {0.0, 0.0, 0.0};
+  for (size_t b = 0; b < boxes.size(); ++b) {
+    bool overlaps = true;
+    for (int d = 0; d < 3; ++d)
+      overlaps = overlaps && boxes[b].lo[d] <= boxes[b].hi[d] && boxes[b].lo[d] <= hi[d] && boxes[b].hi[d] >= lo[d];
+    if (!overlaps)
+      continue;
+    boxIds.push_back(static_cast<int>(b));
+    for (int d = 0; d < 3; ++d)
+      meanSize[d] += std::min(boxes[b].hi[d], hi[d]) - std::max(boxes[b].lo[d], lo[d]);
+  }
+
+  // about one box per cell, total number of cells is limited by 8 cells per box
+  int maxCells = std::max(64, 8 * static_cast<int>(boxIds.size()));
+  for (int d = 0; d < 3; ++d) {
+    double length = hi[d] - lo[d];
+    int ncells = 1;
+    if (!boxIds.empty() && length > 0.0) {
+      meanSize[d] /= boxIds.size();
+      if (meanSize[d] > 0.0)
+        ncells = static_cast<int>(ceil(length / meanSize[d]));
+    }
+    m_ncells[d] = std::max(1, std::min(ncells, maxCellsPerDim));
+  }
+  while (static_cast<double>(m_ncells[0]) * m_ncells[1] * m_ncells[2] > maxCells) {
+    int* largest = std::max_element(m_ncells, m_ncells + 3);
+    *largest = (*largest + 1) / 2;
+  }
+  for (int d = 0; d < 3; ++d) {
+    m_lo[d] = lo[d];
+    m_cellSize[d] = hi[d] > lo[d] ? (hi[d] - lo[d]) / m_ncells[d] : 1.0;
+  }
+
+  // two passes over boxes: count then fill
+  m_cellStart.assign(getNumCells() + 1, 0);
+  m_cellBoxes.clear();
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<int> fill;
+    if (pass == 1) {
+      for (size_t c = 1; c < m_cellStart.size(); ++c)
+        m_cellStart[c] += m_cellStart[c - 1];
+      m_cellBoxes.resize(m_cellStart.back());
+      fill.assign(m_cellStart.begin(), m_cellStart.end() - 1);
+    }
+    for (size_t i = 0; i < boxIds.size(); ++i) {
+      const BoundingBox& box = boxes[boxIds[i]];
+      int clo[3], chi[3], c[3];
+      for (int d = 0; d < 3; ++d) {
+        clo[d] = cellCoord(box.lo[d], d);
+        chi[d] = cellCoord(box.hi[d], d);
+      }
+      for (c[2] = clo[2]; c[2] <= chi[2]; ++c[2])
+        for (c[1] = clo[1]; c[1] <= chi[1]; ++c[1])
+          for (c[0] = clo[0]; c[0] <= chi[0]; ++c[0]) {
+            if (pass == 0)
+              ++m_cellStart[cellIndex(c) + 1];
+            else
+              m_cellBoxes[fill[cellIndex(c)]++] = boxIds[i];
+          }
+    }
+  }
+}
+
+bool BoxGridIndex::getCandidates(const double* x, const int*& begin, const int*& end) const
+{
+  if (m_cellStart.empty())
+    return false;
+  int c[3];
+  for (int d = 0; d < 3; ++d) {
+    double s = (x[d] - m_lo[d]) / m_cellSize[d];
+    if (!(s >= 0.0 && s <= m_ncells[d])) // also rejects nan
+      return false;
+    c[d] = std::min(static_cast<int>(s), m_ncells[d] - 1);
+  }
+  int cell = cellIndex(c);
+  begin = m_cellBoxes.empty() ? 0 : &m_cellBoxes[0] + m_cellStart[cell];
+  end = m_cellBoxes.empty() ? 0 : &m_cellBoxes[0] + m_cellStart[cell + 1];
+  return true;
+}
+
+int BoxGridIndex::cellCoord(double x, int dim) const
+{
+  int c = static_cast<int>(floor((x - m_lo[dim]) / m_cellSize[dim]));
+  return std::max(0, std::min(c, m_ncells[dim] - 1));
+}
@@ -0,0 +1,62 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef BOX_GRID_INDEX_H_
+#define BOX_GRID_INDEX_H_
+
+#include <vector>
+
+/**
+ * Axis aligned box, for instance extent of a region
+ */
+struct BoundingBox
+{
+  double lo[3], hi[3];
+};
+
+/**
+ * @class
+ *  Uniform grid over a domain which gives for a point the boxes which may contain it.
+ *  Every box is listed in all cells it overlaps, boxes outside the domain and empty boxes (lo > hi)
+ *  are not listed.
+ *  Cell size is close to the mean size of boxes, number of cells is limited by the number of boxes.
+ *  Example:
+ *    BoxGridIndex index;
+ *    index.build(boxes, lo, hi);
+ *    const int *begin, *end;
+ *    if (index.getCandidates(x, begin, end))
+ *      for (const int* b = begin; b != end; ++b) test(*b);
+ *    else
+ *      testAll(); // x is outside the domain
+ */
+class BoxGridIndex
+{
+  double m_lo[3], m_cellSize[3];
+  int m_ncells[3];
+  std::vector<int> m_cellStart; // CSR over cells
+  std::vector<int> m_cellBoxes;
+public:
+  BoxGridIndex();
+
+  /**
+   * @param lo, hi
+   *  domain covered by the grid
+   */
+  void build(const std::vector<BoundingBox>& boxes, const double* lo, const double* hi);
+
+  /**
+   * @return
+   *  false if x is outside the domain, otherwise [begin, end) are indices of boxes
+   *  which overlap the cell of x
+   */
+  bool getCandidates(const double* x, const int*& begin, const int*& end) const;
+
+  int getNumCells() const { return m_ncells[0] * m_ncells[1] * m_ncells[2]; }
+
+private:
+  int cellIndex(const int* c) const { return (c[2] * m_ncells[1] + c[1]) * m_ncells[0] + c[0]; }
+  int cellCoord(double x, int dim) const;
+};
+
+#endif /* BOX_GRID_INDEX_H_ */
@@ -61,6 +61,36 @@ struct MPITrait<float>
   MPITrait() : dataType(MPI_FLOAT) {}
 };
 
+// long and long long are sent as fixed width types, so int64_t (tagint, bigint) is MPI_INT64_T
+template<int size>
+struct MPIIntegerTrait;
+
+template<>
+struct MPIIntegerTrait<4>
+{
+  static MPI_Datatype dataType() { return MPI_INT32_T; }
+};
+
+template<>
+struct MPIIntegerTrait<8>
+{
+  static MPI_Datatype dataType() { return MPI_INT64_T; }
+};
+
+template<>
+struct MPITrait<long>
+{
+  MPI_Datatype dataType;
+  MPITrait() : dataType(MPIIntegerTrait<sizeof(long)>::dataType()) {}
+};
+
+template<>
+struct MPITrait<long long>
+{
+  MPI_Datatype dataType;
+  MPITrait() : dataType(MPIIntegerTrait<sizeof(long long)>::dataType()) {}
+};
+
 template<class T>
 static void allGatherUnionOfContainers(const std::vector<T>& localVector, MPI_Comm communicator, std::vector<T>& globalUnionVector)
 {
@@ -107,4 +137,102 @@ static void gatherUnionOfContainers(const std::vector<T>& localVector, MPI_Comm
   MPI_Gatherv(&localWithoutConst[0], localCount, trait.dataType, &globalUnionVector[0], &counts[0], &displs[0], trait.dataType, root, communicator);
 }
 
+/**
+ * Gathers packed records to root. Records are stored as raw bytes, recordType is
+ * a committed derived datatype whose extent is the size of one record in bytes.
+ * Output vector keeps its capacity between calls, so reuse it to avoid reallocations.
+ */
+static void gatherRecords(const std::vector<char>& localRecords, MPI_Datatype recordType,
+                          MPI_Comm communicator, int root, std::vector<char>& globalRecords)
+{
+  MPI_Aint lowerBound = 0, extent = 0;
+  MPI_Type_get_extent(recordType, &lowerBound, &extent);
+
+  int participants = 0;
+  MPI_Comm_size(communicator, &participants);
+  int rank = 0;
+  MPI_Comm_rank(communicator, &rank);
+
+  std::vector<int> counts(participants, 0);
+  int localCount = localRecords.size() / extent;
+  MPI_Gather(&localCount, 1, MPI_INT, &counts[0], 1, MPI_INT, root, communicator);
+
+  int globalCount = 0;
+  std::vector<int> displs(participants, 0);
+  for (int i = 0; i < participants; ++i) {
+    displs[i] += globalCount;
+    globalCount += counts[i];
+  }
+
+  globalRecords.resize(rank == root ? static_cast<size_t>(globalCount) * extent : 0);
+  char* recvBuffer = globalRecords.empty() ? 0 : &globalRecords[0];
+  char* sendBuffer = localRecords.empty() ? 0 : const_cast<char*>(&localRecords[0]);
+  MPI_Gatherv(sendBuffer, localCount, recordType, recvBuffer, &counts[0], &displs[0], recordType, root, communicator);
+}
+
+/**
+ * Sends packed records to their destinations, records in sendRecords are grouped by
+ * destination rank and sendCounts[i] is the number of records for rank i.
+ * Received records are ordered by source rank.
+ */
+static void exchangeRecords(const std::vector<char>& sendRecords, const std::vector<int>& sendCounts,
+                            MPI_Datatype recordType, MPI_Comm communicator, std::vector<char>& recvRecords)
+{
+  MPI_Aint lowerBound = 0, extent = 0;
+  MPI_Type_get_extent(recordType, &lowerBound, &extent);
+
+  int participants = 0;
+  MPI_Comm_size(communicator, &participants);
+
+  std::vector<int> recvCounts(participants, 0);
+  MPI_Alltoall(const_cast<int*>(&sendCounts[0]), 1, MPI_INT, &recvCounts[0], 1, MPI_INT, communicator);
+
+  int sendCount = 0, recvCount = 0;
+  std::vector<int> sendDispls(participants, 0), recvDispls(participants, 0);
+  for (int i = 0; i < participants; ++i) {
+    sendDispls[i] = sendCount;
+    sendCount += sendCounts[i];
+    recvDispls[i] = recvCount;
+    recvCount += recvCounts[i];
+  }
+
+  recvRecords.resize(static_cast<size_t>(recvCount) * extent);
+  char* recvBuffer = recvRecords.empty() ? 0 : &recvRecords[0];
+  char* sendBuffer = sendRecords.empty() ? 0 : const_cast<char*>(&sendRecords[0]);
+  MPI_Alltoallv(sendBuffer, const_cast<int*>(&sendCounts[0]), &sendDispls[0], recordType,
+                recvBuffer, &recvCounts[0], &recvDispls[0], recordType, communicator);
+}
+
+/**
+ * Sends elements of localVector to their destinations, elements are grouped by
+ * destination rank and sendCounts[i] is the number of elements for rank i.
+ * Received elements are ordered by source rank.
+ */
+template<class T>
+static void exchangeContainers(const std::vector<T>& localVector, const std::vector<int>& sendCounts,
+                               MPI_Comm communicator, std::vector<T>& recvVector)
+{
+  MPITrait<T> trait;
+  int participants = 0;
+  MPI_Comm_size(communicator, &participants);
+
+  std::vector<int> recvCounts(participants, 0);
+  MPI_Alltoall(const_cast<int*>(&sendCounts[0]), 1, MPI_INT, &recvCounts[0], 1, MPI_INT, communicator);
+
+  int sendCount = 0, recvCount = 0;
+  std::vector<int> sendDispls(participants, 0), recvDispls(participants, 0);
+  for (int i = 0; i < participants; ++i) {
+    sendDispls[i] = sendCount;
+    sendCount += sendCounts[i];
+    recvDispls[i] = recvCount;
+    recvCount += recvCounts[i];
+  }
+
+  recvVector.resize(recvCount);
+  T* recvBuffer = recvVector.empty() ? 0 : &recvVector[0];
+  T* sendBuffer = localVector.empty() ? 0 : const_cast<T*>(&localVector[0]);
+  MPI_Alltoallv(sendBuffer, const_cast<int*>(&sendCounts[0]), &sendDispls[0], trait.dataType,
+                recvBuffer, &recvCounts[0], &recvDispls[0], trait.dataType, communicator);
+}
+
 #endif /* GATHER_CONTAINERS_H_ */
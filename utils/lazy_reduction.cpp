@@ -0,0 +1,58 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "lazy_reduction.h"
+#include <algorithm>
+#include <assert.h>
+
+LazyReduction::LazyReduction(int size, int maxPending)
+: m_size(size), m_maxPending(maxPending), m_npending(0), m_isRoot(false),
+  m_send(static_cast<size_t>(size) * maxPending, 0.0),
+  m_receive(static_cast<size_t>(size) * maxPending, 0.0),
+  m_requests(maxPending, MPI_REQUEST_NULL)
+{
+  assert(size > 0 && maxPending > 0);
+}
+
+LazyReduction::~LazyReduction()
+{
+  if (m_npending != 0)
+    MPI_Waitall(m_npending, &m_requests[0], MPI_STATUSES_IGNORE);
+}
+
+void LazyReduction::reduce(const double* local, int root, MPI_Comm comm)
+{
+  assert(!isFull());
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  m_isRoot = rank == root;
+
+  // buffers of a pending reduction must not be touched until it is completed
+  double* send = &m_send[static_cast<size_t>(m_npending) * m_size];
+  double* receive = &m_receive[static_cast<size_t>(m_npending) * m_size];
+  std::copy(local, local + m_size, send);
+  MPI_Ireduce(send, receive, m_size, MPI_DOUBLE, MPI_SUM, root, comm, &m_requests[m_npending]);
+  ++m_npending;
+}
+
+void LazyReduction::progress()
+{
+  if (m_npending == 0)
+    return;
+  int flag;
+  MPI_Testall(m_npending, &m_requests[0], &flag, MPI_STATUSES_IGNORE);
+}
+
+int LazyReduction::complete(std::vector<double>& results)
+{
+  if (m_npending == 0)
+    return 0;
+  // completed requests are set to MPI_REQUEST_NULL by progress, Waitall ignores them
+  MPI_Waitall(m_npending, &m_requests[0], MPI_STATUSES_IGNORE);
+
+  int ncompleted = m_isRoot ? m_npending : 0;
+  results.insert(results.end(), m_receive.begin(), m_receive.begin() + static_cast<size_t>(ncompleted) * m_size);
+  m_npending = 0;
+  return ncompleted;
+}
@@ -0,0 +1,69 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef LAZY_REDUCTION_H_
+#define LAZY_REDUCTION_H_
+
+#include "mpi.h"
+#include <vector>
+
+/**
+ * @class
+ *  Sum reductions of fixed size arrays which are started every sample with MPI_Ireduce
+ *  and completed only when results are needed, so samples are not synchronized.
+ *  At most maxPending reductions are in flight, all of them must use the same communicator
+ *  and root, so they must be completed before the communicator is changed.
+ *  Requires MPI-3.
+ *  Example:
+ *    LazyReduction reduction(4);
+ *    if (reduction.isFull())
+ *      reduction.complete(results);
+ *    reduction.reduce(local, root, comm); // every sample
+ *    reduction.complete(results); // output step, results[sample * 4 + i] on root
+ */
+class LazyReduction
+{
+  int m_size, m_maxPending, m_npending;
+  bool m_isRoot; // this proc is the root of pending reductions
+  std::vector<double> m_send, m_receive;
+  std::vector<MPI_Request> m_requests;
+public:
+  // reductions in flight, if there are more they are completed before the output step
+  static const int defaultMaxPending = 16;
+
+  explicit LazyReduction(int size, int maxPending = defaultMaxPending);
+
+  /**
+   * Waits for pending reductions, results are lost
+   */
+  ~LazyReduction();
+
+  int getSize() const { return m_size; }
+
+  bool isFull() const { return m_npending == m_maxPending; }
+
+  /**
+   * Starts reduction of size doubles, must not be called if isFull()
+   */
+  void reduce(const double* local, int root, MPI_Comm comm);
+
+  /**
+   * Lets MPI progress pending reductions without waiting
+   */
+  void progress();
+
+  /**
+   * Waits for pending reductions and appends their results in the order they were started,
+   * results are appended only on the root
+   * @return
+   *  number of appended results
+   */
+  int complete(std::vector<double>& results);
+
+private:
+  LazyReduction(const LazyReduction&);
+  LazyReduction& operator=(const LazyReduction&);
+};
+
+#endif /* LAZY_REDUCTION_H_ */
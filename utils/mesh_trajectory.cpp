@@ -0,0 +1,567 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "mesh_trajectory.h"
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#ifdef MESH_TRAJECTORY_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace MeshTrajectory;
+
+namespace {
+  template<class T>
+  void writeValue(std::ofstream& file, T value)
+  {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<class T>
+  T readValue(const char* bytes)
+  {
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+
+  template<class T>
+  void append(std::vector<char>& buffer, T value)
+  {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+
+  const double maxLevel = 65535.0;
+}
+
+// MeshTrajectoryWriter
+
+MeshTrajectoryWriter::MeshTrajectoryWriter(const std::string& fileName)
+: m_topologyOffset(0), m_newTopology(false)
+{
+  m_file.open(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!m_file.is_open())
+    throw std::runtime_error("could not open output file " + fileName);
+  m_file.write(magic, sizeof(magic));
+  writeValue(m_file, version);
+  writeValue(m_file, byteOrderMark);
+  m_file.flush();
+}
+
+MeshTrajectoryWriter::~MeshTrajectoryWriter()
+{
+  try
+  {
+    close();
+  }
+  catch(...)
+  {
+  }
+}
+
+void MeshTrajectoryWriter::writeRecordHeader(const char* kind, uint32_t flags, int64_t timestep, uint64_t payloadBytes)
+{
+  m_file.write(kind, 4);
+  writeValue(m_file, flags);
+  writeValue(m_file, timestep);
+  writeValue(m_file, payloadBytes);
+}
+
+void MeshTrajectoryWriter::writeAttributeNames(const std::vector<std::string>& names)
+{
+  if (static_cast<uint64_t>(m_file.tellp()) != headerSize)
+    throw std::runtime_error("attribute names must be written before topology and frames");
+
+  std::vector<char> payload;
+  append(payload, static_cast<uint32_t>(names.size()));
+  for (size_t i = 0; i < names.size(); ++i) {
+    append(payload, static_cast<uint32_t>(names[i].size()));
+    payload.insert(payload.end(), names[i].begin(), names[i].end());
+  }
+  writeRecordHeader("ATTR", 0, 0, payload.size());
+  m_file.write(&payload[0], payload.size());
+  m_file.flush();
+}
+
+void MeshTrajectoryWriter::writeTopology(int64_t timestep, int64_t nvertices, const std::vector<int>& faces)
+{
+  m_topologyOffset = m_file.tellp();
+  int64_t nfaces = faces.size() / 3;
+  writeRecordHeader("TOPO", 0, timestep, 2 * sizeof(int64_t) + faces.size() * sizeof(int32_t));
+  writeValue(m_file, nvertices);
+  writeValue(m_file, nfaces);
+  std::vector<int32_t> faces32(faces.begin(), faces.end());
+  if (!faces32.empty())
+    m_file.write(reinterpret_cast<const char*>(&faces32[0]), faces32.size() * sizeof(int32_t));
+  m_newTopology = true;
+}
+
+void MeshTrajectoryWriter::writeFrame(int64_t timestep, int64_t nvertices, int stride, const float* data)
+{
+  writeFrame(timestep, nvertices, stride, RAW_FLOAT32, reinterpret_cast<const char*>(data),
+             static_cast<size_t>(nvertices) * stride * sizeof(float));
+}
+
+void MeshTrajectoryWriter::writeFrame(int64_t timestep, int64_t nvertices, int stride, uint32_t encoding,
+                                      const char* payload, size_t payloadBytes, uint32_t flags)
+{
+  if (!m_file.is_open())
+    throw std::runtime_error("trajectory file is closed");
+
+  IndexEntry entry = {timestep, static_cast<uint64_t>(m_file.tellp()), m_topologyOffset};
+  writeRecordHeader("FRAM", flags | (m_newTopology ? NEW_TOPOLOGY : 0), timestep, framePrefixSize + payloadBytes);
+  writeValue(m_file, encoding);
+  writeValue(m_file, static_cast<uint32_t>(stride));
+  writeValue(m_file, nvertices);
+  if (payloadBytes)
+    m_file.write(payload, payloadBytes);
+  m_file.flush();
+  if (!m_file)
+    throw std::runtime_error("could not write trajectory frame");
+
+  m_index.push_back(entry);
+  m_newTopology = false;
+}
+
+void MeshTrajectoryWriter::close()
+{
+  if (!m_file.is_open())
+    return;
+
+  uint64_t indexOffset = m_file.tellp();
+  int64_t nframes = m_index.size();
+  writeRecordHeader("INDX", 0, 0, sizeof(int64_t) + m_index.size() * 3 * sizeof(int64_t));
+  writeValue(m_file, nframes);
+  for (size_t i = 0; i < m_index.size(); ++i) {
+    writeValue(m_file, m_index[i].timestep);
+    writeValue(m_file, m_index[i].frameOffset);
+    writeValue(m_file, m_index[i].topologyOffset);
+  }
+  writeValue(m_file, indexOffset);
+  m_file.write(indexMagic, sizeof(indexMagic));
+  m_file.close();
+}
+
+// QuantizedFrameEncoder
+
+QuantizedFrameEncoder::QuantizedFrameEncoder(const QuantizationOptions& options)
+: m_options(options), m_framesSinceKeyframe(0), m_stride(0)
+{
+  if (m_options.compress && !compressionAvailable())
+    throw std::runtime_error("mesh trajectory compression requires zlib");
+  for (int c = 0; c < 3; ++c) {
+    m_origin[c] = 0.0;
+    m_step[c] = 1.0;
+  }
+}
+
+bool QuantizedFrameEncoder::compressionAvailable()
+{
+#ifdef MESH_TRAJECTORY_ZLIB
+  return true;
+#else
+  return false;
+#endif
+}
+
+void QuantizedFrameEncoder::setGrid(int64_t nvertices, int stride, const float* data,
+                                    const double* boxlo, const double* boxhi)
+{
+  double lo[3] = {0.0, 0.0, 0.0}, hi[3] = {0.0, 0.0, 0.0};
+  for (int64_t i = 0; i < nvertices; ++i) {
+    const float* p = data + i * stride;
+    for (int c = 0; c < 3; ++c) {
+      if (i == 0 || p[c] < lo[c]) lo[c] = p[c];
+      if (i == 0 || p[c] > hi[c]) hi[c] = p[c];
+    }
+  }
+
+  for (int c = 0; c < 3; ++c) {
+    if (m_options.useDomain) {
+      lo[c] = nvertices ? std::min(lo[c], boxlo[c]) : boxlo[c];
+      hi[c] = nvertices ? std::max(hi[c], boxhi[c]) : boxhi[c];
+    } else if (m_options.keyframeInterval > 1) {
+      // margin lets following delta frames stay on the grid of the keyframe
+      double margin = 0.05 * (hi[c] - lo[c]);
+      lo[c] -= margin;
+      hi[c] += margin;
+    }
+    m_origin[c] = lo[c];
+    m_step[c] = hi[c] > lo[c] ? (hi[c] - lo[c]) / maxLevel : 1.0;
+  }
+}
+
+bool QuantizedFrameEncoder::isInsideGrid(int64_t nvertices, int stride, const float* data) const
+{
+  for (int64_t i = 0; i < nvertices; ++i) {
+    const float* p = data + i * stride;
+    for (int c = 0; c < 3; ++c) {
+      double t = (p[c] - m_origin[c]) / m_step[c];
+      if (t < -0.5 || t > maxLevel + 0.5)
+        return false;
+    }
+  }
+  return true;
+}
+
+bool QuantizedFrameEncoder::encode(int64_t nvertices, int stride, const float* data,
+                                   const double* boxlo, const double* boxhi, std::vector<char>& payload)
+{
+  if (stride < 3)
+    throw std::runtime_error("quantized frame requires x, y, z");
+
+  size_t ncoords = 3 * static_cast<size_t>(nvertices);
+  bool delta = m_options.keyframeInterval > 1 && m_framesSinceKeyframe < m_options.keyframeInterval &&
+               m_previous.size() == ncoords && m_stride == stride && isInsideGrid(nvertices, stride, data);
+  if (!delta) {
+    setGrid(nvertices, stride, data, boxlo, boxhi);
+    m_framesSinceKeyframe = 0;
+  }
+  m_stride = stride;
+
+  // quantize and measure the actual error
+  double maxError = 0.0;
+  m_quantized.resize(ncoords);
+  for (int64_t i = 0; i < nvertices; ++i) {
+    const float* p = data + i * stride;
+    for (int c = 0; c < 3; ++c) {
+      double t = floor((p[c] - m_origin[c]) / m_step[c] + 0.5);
+      t = std::max(0.0, std::min(maxLevel, t));
+      maxError = std::max(maxError, fabs(m_origin[c] + t * m_step[c] - p[c]));
+      m_quantized[3 * i + c] = static_cast<uint16_t>(t);
+    }
+  }
+
+  // shuffled bytes of values, then the rest of vertex data as is
+  size_t nrest = static_cast<size_t>(nvertices) * (stride - 3);
+  m_body.resize(2 * ncoords + nrest * sizeof(float));
+  for (size_t j = 0; j < ncoords; ++j) {
+    uint16_t value = delta ? static_cast<uint16_t>(m_quantized[j] - m_previous[j]) : m_quantized[j];
+    m_body[j] = static_cast<char>(value & 0xff);
+    m_body[ncoords + j] = static_cast<char>(value >> 8);
+  }
+  if (nrest) {
+    char* rest = &m_body[2 * ncoords];
+    for (int64_t i = 0; i < nvertices; ++i, rest += (stride - 3) * sizeof(float))
+      memcpy(rest, data + i * stride + 3, (stride - 3) * sizeof(float));
+  }
+  m_previous.swap(m_quantized);
+  ++m_framesSinceKeyframe;
+
+  uint32_t flags = QUANTIZED_SHUFFLED | (delta ? QUANTIZED_DELTA : 0);
+  const char* stored = m_body.empty() ? 0 : &m_body[0];
+  uint64_t storedBytes = m_body.size();
+#ifdef MESH_TRAJECTORY_ZLIB
+  std::vector<Bytef> compressed;
+  if (m_options.compress && !m_body.empty()) {
+    uLongf compressedBytes = compressBound(m_body.size());
+    compressed.resize(compressedBytes);
+    if (compress2(&compressed[0], &compressedBytes, reinterpret_cast<const Bytef*>(&m_body[0]), m_body.size(),
+                  Z_DEFAULT_COMPRESSION) == Z_OK && compressedBytes < m_body.size()) {
+      flags |= QUANTIZED_ZLIB;
+      stored = reinterpret_cast<const char*>(&compressed[0]);
+      storedBytes = compressedBytes;
+    }
+  }
+#endif
+
+  payload.clear();
+  payload.reserve(quantizedHeaderSize + storedBytes);
+  append(payload, flags);
+  append(payload, static_cast<uint32_t>(0));
+  for (int c = 0; c < 3; ++c)
+    append(payload, m_origin[c]);
+  for (int c = 0; c < 3; ++c)
+    append(payload, m_step[c]);
+  append(payload, maxError);
+  append(payload, static_cast<uint64_t>(m_body.size()));
+  append(payload, storedBytes);
+  if (storedBytes)
+    payload.insert(payload.end(), stored, stored + storedBytes);
+  return delta;
+}
+
+// MeshTrajectoryReader
+
+MeshTrajectoryReader::MeshTrajectoryReader(const std::string& fileName)
+: m_hadIndex(false), m_lastDecoded(static_cast<size_t>(-1))
+{
+  m_file.open(fileName.c_str(), std::ios::in | std::ios::binary);
+  if (!m_file.is_open())
+    throw std::runtime_error("could not open trajectory file " + fileName);
+
+  char header[headerSize];
+  if (!m_file.read(header, headerSize) || memcmp(header, magic, sizeof(magic)) != 0)
+    throw std::runtime_error("not a mesh trajectory file " + fileName);
+  if (readValue<uint32_t>(header + 12) != byteOrderMark)
+    throw std::runtime_error("mesh trajectory file has different byte order " + fileName);
+
+  m_file.seekg(0, std::ios::end);
+  uint64_t fileSize = m_file.tellg();
+
+  m_hadIndex = readIndex(fileSize);
+  if (!m_hadIndex)
+    scanRecords(fileSize);
+  readAttributeNames(fileSize);
+}
+
+void MeshTrajectoryReader::readRecordHeader(uint64_t offset, char* kind, uint32_t& flags,
+                                            int64_t& timestep, uint64_t& payloadBytes) const
+{
+  char bytes[recordHeaderSize];
+  m_file.clear();
+  m_file.seekg(offset);
+  if (!m_file.read(bytes, recordHeaderSize))
+    throw std::runtime_error("truncated mesh trajectory record");
+  memcpy(kind, bytes, 4);
+  flags = readValue<uint32_t>(bytes + 4);
+  timestep = readValue<int64_t>(bytes + 8);
+  payloadBytes = readValue<uint64_t>(bytes + 16);
+}
+
+bool MeshTrajectoryReader::readIndex(uint64_t fileSize)
+{
+  if (fileSize < headerSize + footerSize)
+    return false;
+
+  char footer[footerSize];
+  m_file.clear();
+  m_file.seekg(fileSize - footerSize);
+  if (!m_file.read(footer, footerSize) || memcmp(footer + 8, indexMagic, sizeof(indexMagic)) != 0)
+    return false;
+
+  uint64_t indexOffset = readValue<uint64_t>(footer);
+  if (indexOffset + recordHeaderSize > fileSize)
+    return false;
+
+  char kind[4];
+  uint32_t flags;
+  int64_t timestep;
+  uint64_t payloadBytes;
+  readRecordHeader(indexOffset, kind, flags, timestep, payloadBytes);
+  if (memcmp(kind, "INDX", 4) != 0 || indexOffset + recordHeaderSize + payloadBytes + footerSize != fileSize)
+    return false;
+
+  std::vector<char> payload(payloadBytes);
+  if (payloadBytes < sizeof(int64_t) || !m_file.read(&payload[0], payloadBytes))
+    return false;
+  int64_t nframes = readValue<int64_t>(&payload[0]);
+  if (static_cast<uint64_t>(nframes) * 3 * sizeof(int64_t) + sizeof(int64_t) != payloadBytes)
+    return false;
+
+  m_index.resize(nframes);
+  const char* entry = &payload[sizeof(int64_t)];
+  for (int64_t i = 0; i < nframes; ++i, entry += 3 * sizeof(int64_t)) {
+    m_index[i].timestep = readValue<int64_t>(entry);
+    m_index[i].frameOffset = readValue<uint64_t>(entry + 8);
+    m_index[i].topologyOffset = readValue<uint64_t>(entry + 16);
+  }
+  return true;
+}
+
+void MeshTrajectoryReader::readAttributeNames(uint64_t fileSize)
+{
+  m_attributeNames.clear();
+  if (fileSize < headerSize + recordHeaderSize)
+    return;
+
+  char kind[4];
+  uint32_t flags;
+  int64_t timestep;
+  uint64_t payloadBytes;
+  readRecordHeader(headerSize, kind, flags, timestep, payloadBytes);
+  if (memcmp(kind, "ATTR", 4) != 0)
+    return;
+  if (headerSize + recordHeaderSize + payloadBytes > fileSize || payloadBytes < sizeof(uint32_t))
+    throw std::runtime_error("truncated mesh trajectory attribute record");
+
+  std::vector<char> payload(payloadBytes);
+  if (!m_file.read(&payload[0], payloadBytes))
+    throw std::runtime_error("truncated mesh trajectory attribute record");
+  uint32_t nattributes = readValue<uint32_t>(&payload[0]);
+  size_t position = sizeof(uint32_t);
+  for (uint32_t i = 0; i < nattributes; ++i) {
+    if (position + sizeof(uint32_t) > payload.size())
+      throw std::runtime_error("corrupted mesh trajectory attribute record");
+    uint32_t length = readValue<uint32_t>(&payload[position]);
+    position += sizeof(uint32_t);
+    if (position + length > payload.size())
+      throw std::runtime_error("corrupted mesh trajectory attribute record");
+    m_attributeNames.push_back(std::string(&payload[position], length));
+    position += length;
+  }
+}
+
+void MeshTrajectoryReader::scanRecords(uint64_t fileSize)
+{
+  m_index.clear();
+  uint64_t topologyOffset = 0;
+  uint64_t offset = headerSize;
+  while (offset + recordHeaderSize <= fileSize) {
+    char kind[4];
+    uint32_t flags;
+    int64_t timestep;
+    uint64_t payloadBytes;
+    readRecordHeader(offset, kind, flags, timestep, payloadBytes);
+    uint64_t next = offset + recordHeaderSize + payloadBytes;
+    if (next > fileSize)
+      break; // last record was not completely written
+    if (memcmp(kind, "TOPO", 4) == 0) {
+      topologyOffset = offset;
+    } else if (memcmp(kind, "FRAM", 4) == 0) {
+      IndexEntry entry = {timestep, offset, topologyOffset};
+      m_index.push_back(entry);
+    } else if (memcmp(kind, "INDX", 4) != 0 && memcmp(kind, "ATTR", 4) != 0) {
+      break; // garbage after a crash
+    }
+    offset = next;
+  }
+}
+
+void MeshTrajectoryReader::readFaces(size_t frame, std::vector<int>& faces) const
+{
+  char kind[4];
+  uint32_t flags;
+  int64_t timestep;
+  uint64_t payloadBytes;
+  readRecordHeader(m_index.at(frame).topologyOffset, kind, flags, timestep, payloadBytes);
+  if (memcmp(kind, "TOPO", 4) != 0)
+    throw std::runtime_error("frame has no topology record");
+
+  char counts[2 * sizeof(int64_t)];
+  m_file.read(counts, sizeof(counts));
+  int64_t nfaces = readValue<int64_t>(counts + sizeof(int64_t));
+  std::vector<int32_t> faces32(3 * nfaces);
+  if (nfaces)
+    m_file.read(reinterpret_cast<char*>(&faces32[0]), faces32.size() * sizeof(int32_t));
+  if (!m_file)
+    throw std::runtime_error("truncated topology record");
+  faces.assign(faces32.begin(), faces32.end());
+}
+
+void MeshTrajectoryReader::readFrameRecord(size_t frame, uint32_t& flags, uint32_t& encoding, int64_t& nvertices,
+                                           int& stride, std::vector<char>& payload) const
+{
+  char kind[4];
+  int64_t timestep;
+  uint64_t payloadBytes;
+  readRecordHeader(m_index.at(frame).frameOffset, kind, flags, timestep, payloadBytes);
+  if (memcmp(kind, "FRAM", 4) != 0 || payloadBytes < framePrefixSize)
+    throw std::runtime_error("invalid frame record");
+
+  char prefix[framePrefixSize];
+  m_file.read(prefix, framePrefixSize);
+  encoding = readValue<uint32_t>(prefix);
+  stride = readValue<uint32_t>(prefix + 4);
+  nvertices = readValue<int64_t>(prefix + 8);
+
+  payload.resize(payloadBytes - framePrefixSize);
+  if (!payload.empty())
+    m_file.read(&payload[0], payload.size());
+  if (!m_file)
+    throw std::runtime_error("truncated frame record");
+}
+
+void MeshTrajectoryReader::readFrame(size_t frame, std::vector<float>& data, int& stride)
+{
+  uint32_t flags, encoding;
+  int64_t nvertices;
+  std::vector<char> payload;
+  readFrameRecord(frame, flags, encoding, nvertices, stride, payload);
+
+  if (encoding == RAW_FLOAT32) {
+    data.resize(static_cast<size_t>(nvertices) * stride);
+    if (payload.size() != data.size() * sizeof(float))
+      throw std::runtime_error("invalid frame size");
+    if (!data.empty())
+      memcpy(&data[0], &payload[0], payload.size());
+    return;
+  }
+  if (encoding != QUANTIZED16)
+    throw std::runtime_error("unknown frame encoding");
+
+  if ((flags & DELTA) && !(frame > 0 && m_lastDecoded == frame - 1 && !m_lastQuantized.empty())) {
+    // decode from the keyframe
+    size_t keyframe = frame;
+    while (keyframe > 0 && (flags & DELTA)) {
+      char kind[4];
+      int64_t timestep;
+      uint64_t payloadBytes;
+      readRecordHeader(m_index[--keyframe].frameOffset, kind, flags, timestep, payloadBytes);
+    }
+    std::vector<char> previousPayload;
+    std::vector<float> previousData;
+    for (size_t i = keyframe; i < frame; ++i) {
+      uint32_t previousFlags, previousEncoding;
+      int64_t previousNvertices;
+      int previousStride;
+      readFrameRecord(i, previousFlags, previousEncoding, previousNvertices, previousStride, previousPayload);
+      decodeQuantized(i, previousNvertices, previousStride, previousPayload, previousData);
+    }
+  }
+  decodeQuantized(frame, nvertices, stride, payload, data);
+}
+
+void MeshTrajectoryReader::decodeQuantized(size_t frame, int64_t nvertices, int stride,
+                                           const std::vector<char>& payload, std::vector<float>& data)
+{
+  if (payload.size() < quantizedHeaderSize || stride < 3)
+    throw std::runtime_error("invalid quantized frame");
+  const char* header = &payload[0];
+  uint32_t flags = readValue<uint32_t>(header);
+  double origin[3], step[3];
+  for (int c = 0; c < 3; ++c) {
+    origin[c] = readValue<double>(header + 8 + c * sizeof(double));
+    step[c] = readValue<double>(header + 32 + c * sizeof(double));
+  }
+  uint64_t bodyBytes = readValue<uint64_t>(header + 64);
+  uint64_t storedBytes = readValue<uint64_t>(header + 72);
+  if (quantizedHeaderSize + storedBytes != payload.size())
+    throw std::runtime_error("invalid quantized frame size");
+
+  std::vector<char> decompressed;
+  const char* body = &payload[0] + quantizedHeaderSize;
+  if (flags & QUANTIZED_ZLIB) {
+#ifdef MESH_TRAJECTORY_ZLIB
+    decompressed.resize(bodyBytes);
+    uLongf decompressedBytes = bodyBytes;
+    if (uncompress(reinterpret_cast<Bytef*>(&decompressed[0]), &decompressedBytes,
+                   reinterpret_cast<const Bytef*>(body), storedBytes) != Z_OK || decompressedBytes != bodyBytes)
+      throw std::runtime_error("could not decompress frame");
+    body = &decompressed[0];
+#else
+    throw std::runtime_error("mesh trajectory decompression requires zlib");
+#endif
+  }
+
+  size_t ncoords = 3 * static_cast<size_t>(nvertices);
+  size_t nrest = static_cast<size_t>(nvertices) * (stride - 3);
+  if (bodyBytes != 2 * ncoords + nrest * sizeof(float))
+    throw std::runtime_error("invalid quantized frame size");
+
+  bool delta = flags & QUANTIZED_DELTA;
+  if (delta && !(frame > 0 && m_lastDecoded == frame - 1 && m_lastQuantized.size() == ncoords))
+    throw std::runtime_error("delta frame without previous frame");
+  m_lastQuantized.resize(ncoords);
+  for (size_t j = 0; j < ncoords; ++j) {
+    uint16_t value = static_cast<unsigned char>(body[j]) | (static_cast<unsigned char>(body[ncoords + j]) << 8);
+    m_lastQuantized[j] = delta ? static_cast<uint16_t>(m_lastQuantized[j] + value) : value;
+  }
+  m_lastDecoded = frame;
+
+  data.resize(static_cast<size_t>(nvertices) * stride);
+  const char* rest = body + 2 * ncoords;
+  for (int64_t i = 0; i < nvertices; ++i) {
+    float* p = &data[i * stride];
+    for (int c = 0; c < 3; ++c)
+      p[c] = static_cast<float>(origin[c] + m_lastQuantized[3 * i + c] * step[c]);
+    if (stride > 3) {
+      memcpy(p + 3, rest, (stride - 3) * sizeof(float));
+      rest += (stride - 3) * sizeof(float);
+    }
+  }
+}
@@ -0,0 +1,220 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef MESH_TRAJECTORY_H_
+#define MESH_TRAJECTORY_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+
+/**
+ * Single file mesh trajectory, all numbers are in the byte order of the writer host,
+ * it is checked by the reader using byte order mark.
+ *
+ *   header:  char[8] "LMPMTRJ1", uint32 version, uint32 byte order mark 0x01020304
+ *   records: char[4] kind, uint32 flags, int64 timestep, uint64 payload bytes, payload
+ *     "ATTR": uint32 nattributes, nattributes x [uint32 length, char name[length]],
+ *             names of vertex floats after x, y, z, optional, only directly after the header
+ *     "TOPO": int64 nvertices, int64 nfaces, int32 faces[3 * nfaces]
+ *     "FRAM": uint32 encoding, uint32 stride, int64 nvertices, vertex data
+ *             encoding 0 is float32 data[nvertices * stride], first three floats are x, y, z
+ *             encoding 1 is quantized: uint32 flags, uint32 0, float64 origin[3], step[3], max error,
+ *               uint64 body bytes, uint64 stored bytes, stored body (zlib compressed if flags & 4).
+ *               Body is uint16 q[nvertices * 3] stored as all low bytes followed by all high bytes,
+ *               then float32 rest[nvertices * (stride - 3)]. x = origin + q * step.
+ *               If flags & 1 (delta) q is difference modulo 2^16 to the previous frame,
+ *               grid is the same as in the previous frame, record flags have DELTA too.
+ *     "INDX": int64 nframes, nframes x [int64 timestep, uint64 frame offset, uint64 topology offset]
+ *   footer:  uint64 offset of INDX record, char[8] "LMPMIDX1"
+ *
+ * Topology is written once and again only if it changes, every frame uses the last
+ * topology record written before it. Index and footer are written on close, if they are
+ * missing (crashed run) the reader rebuilds the index by scanning records.
+ */
+namespace MeshTrajectory {
+  const char magic[8] = {'L', 'M', 'P', 'M', 'T', 'R', 'J', '1'};
+  const char indexMagic[8] = {'L', 'M', 'P', 'M', 'I', 'D', 'X', '1'};
+  const uint32_t version = 1;
+  const uint32_t byteOrderMark = 0x01020304;
+  const size_t headerSize = 16;
+  const size_t recordHeaderSize = 24;
+  const size_t framePrefixSize = 16; // encoding, stride, nvertices
+  const size_t footerSize = 16;
+
+  const size_t quantizedHeaderSize = 80;
+
+  enum Encoding { RAW_FLOAT32 = 0, QUANTIZED16 = 1 };
+  enum FrameFlags { NEW_TOPOLOGY = 1, DELTA = 2 };
+  enum QuantizedFlags { QUANTIZED_DELTA = 1, QUANTIZED_SHUFFLED = 2, QUANTIZED_ZLIB = 4 };
+}
+
+/**
+ * Quantization of positions to 16 bit integers on a uniform grid.
+ * Grid is the bounding box of the frame or the domain box (extended by the frame bounding box if needed).
+ * With keyframe interval K > 1 frames between keyframes are stored as differences to the previous frame,
+ * new keyframe is also started when a vertex leaves the grid of the current keyframe.
+ */
+struct QuantizationOptions
+{
+  bool enabled;
+  bool useDomain;
+  int keyframeInterval; // 1 means no delta frames
+  bool compress; // zlib, requires MESH_TRAJECTORY_ZLIB
+
+  QuantizationOptions()
+  : enabled(false), useDomain(false), keyframeInterval(1), compress(false)
+  {
+  }
+};
+
+/**
+ * @class
+ *  Encodes frames with QUANTIZED16 encoding, keeps the previous frame for delta frames.
+ */
+class QuantizedFrameEncoder
+{
+  QuantizationOptions m_options;
+  std::vector<uint16_t> m_previous;
+  double m_origin[3], m_step[3];
+  int m_framesSinceKeyframe;
+  int m_stride;
+  std::vector<uint16_t> m_quantized;
+  std::vector<char> m_body;
+public:
+  explicit QuantizedFrameEncoder(const QuantizationOptions& options);
+
+  /**
+   * @param boxlo, boxhi
+   *  domain box, used if options.useDomain
+   * @param payload
+   *  vertex data in QUANTIZED16 encoding
+   * @return
+   *  true if the frame is a delta frame
+   */
+  bool encode(int64_t nvertices, int stride, const float* data, const double* boxlo, const double* boxhi,
+              std::vector<char>& payload);
+
+  /**
+   * @return
+   *  true if the library was compiled with zlib
+   */
+  static bool compressionAvailable();
+
+private:
+  void setGrid(int64_t nvertices, int stride, const float* data, const double* boxlo, const double* boxhi);
+  bool isInsideGrid(int64_t nvertices, int stride, const float* data) const;
+};
+
+/**
+ * @class
+ *  Appends topology and frames to a trajectory file, index is written on close.
+ */
+class MeshTrajectoryWriter
+{
+  std::ofstream m_file;
+  struct IndexEntry { int64_t timestep; uint64_t frameOffset, topologyOffset; };
+  std::vector<IndexEntry> m_index;
+  uint64_t m_topologyOffset;
+  bool m_newTopology;
+public:
+  explicit MeshTrajectoryWriter(const std::string& fileName);
+  ~MeshTrajectoryWriter();
+
+  /**
+   * Writes names of vertex attributes, must be called before anything else is written
+   */
+  void writeAttributeNames(const std::vector<std::string>& names);
+
+  void writeTopology(int64_t timestep, int64_t nvertices, const std::vector<int>& faces);
+
+  /**
+   * @param data
+   *  nvertices * stride floats
+   */
+  void writeFrame(int64_t timestep, int64_t nvertices, int stride, const float* data);
+
+  /**
+   * Writes frame with already encoded vertex data
+   */
+  void writeFrame(int64_t timestep, int64_t nvertices, int stride, uint32_t encoding,
+                  const char* payload, size_t payloadBytes, uint32_t flags = 0);
+
+  /**
+   * Writes index and footer, called by destructor
+   */
+  void close();
+
+private:
+  void writeRecordHeader(const char* kind, uint32_t flags, int64_t timestep, uint64_t payloadBytes);
+
+  MeshTrajectoryWriter(const MeshTrajectoryWriter&);
+  MeshTrajectoryWriter& operator=(const MeshTrajectoryWriter&);
+};
+
+/**
+ * @class
+ *  Random access to frames of a trajectory file.
+ *  Example:
+ *    MeshTrajectoryReader reader("mesh.traj");
+ *    for (size_t i = 0; i < reader.getNumFrames(); ++i) {
+ *      reader.readFaces(i, faces);
+ *      reader.readFrame(i, data, stride);
+ *    }
+ */
+class MeshTrajectoryReader
+{
+  mutable std::ifstream m_file;
+  struct IndexEntry { int64_t timestep; uint64_t frameOffset, topologyOffset; };
+  std::vector<IndexEntry> m_index;
+  bool m_hadIndex;
+  std::vector<std::string> m_attributeNames;
+  size_t m_lastDecoded; // frame whose quantized values are in m_lastQuantized, size_t(-1) if none
+  std::vector<uint16_t> m_lastQuantized;
+public:
+  explicit MeshTrajectoryReader(const std::string& fileName);
+
+  size_t getNumFrames() const { return m_index.size(); }
+
+  int64_t getTimestep(size_t frame) const { return m_index.at(frame).timestep; }
+
+  /**
+   * @return
+   *  false if index was missing and had to be rebuilt by scanning the file
+   */
+  bool hadIndex() const { return m_hadIndex; }
+
+  /**
+   * @return
+   *  names of vertex floats after x, y, z, empty if the file has no attribute record
+   */
+  const std::vector<std::string>& getAttributeNames() const { return m_attributeNames; }
+
+  /**
+   * reads vertex data of the frame decoded to float, stride floats per vertex.
+   * Delta frames are decoded starting from their keyframe, sequential reading decodes every frame once.
+   */
+  void readFrame(size_t frame, std::vector<float>& data, int& stride);
+
+  /**
+   * reads faces (linearized triangles of vertex indices) valid for the frame
+   */
+  void readFaces(size_t frame, std::vector<int>& faces) const;
+
+private:
+  bool readIndex(uint64_t fileSize);
+  void readAttributeNames(uint64_t fileSize);
+  void scanRecords(uint64_t fileSize);
+  void readRecordHeader(uint64_t offset, char* kind, uint32_t& flags, int64_t& timestep, uint64_t& payloadBytes) const;
+  void readFrameRecord(size_t frame, uint32_t& flags, uint32_t& encoding, int64_t& nvertices, int& stride,
+                       std::vector<char>& payload) const;
+  void decodeQuantized(size_t frame, int64_t nvertices, int stride, const std::vector<char>& payload,
+                       std::vector<float>& data);
+
+  MeshTrajectoryReader(const MeshTrajectoryReader&);
+  MeshTrajectoryReader& operator=(const MeshTrajectoryReader&);
+};
+
+#endif /* MESH_TRAJECTORY_H_ */
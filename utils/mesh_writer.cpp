@@ -0,0 +1,350 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "mesh_writer.h"
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+
+namespace {
+  bool isLittleEndian()
+  {
+    const uint16_t one = 1;
+    return *reinterpret_cast<const char*>(&one) == 1;
+  }
+
+  template<class T>
+  void append(std::vector<char>& buffer, const T* data, size_t count)
+  {
+    const char* bytes = reinterpret_cast<const char*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+  }
+
+  std::string baseName(const std::string& path)
+  {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+  }
+
+  void openOutput(std::ofstream& file, const std::string& fileName)
+  {
+    file.open(fileName.c_str(), std::ios::out | std::ios::binary);
+    if (!file.is_open())
+      throw std::runtime_error("could not open output file " + fileName);
+  }
+
+  // x, y, z of every vertex as contiguous float triplets
+  const float* packPositions(const MeshFrame& frame, std::vector<float>& buffer)
+  {
+    if (frame.stride == 3)
+      return frame.data;
+    buffer.resize(3 * static_cast<size_t>(frame.nvertices));
+    for (int i = 0; i < frame.nvertices; ++i) {
+      memcpy(&buffer[3 * static_cast<size_t>(i)], frame.data + static_cast<size_t>(i) * frame.stride, 3 * sizeof(float));
+    }
+    return buffer.empty() ? 0 : &buffer[0];
+  }
+
+  // attribute k of every vertex as contiguous floats
+  const float* packAttribute(const MeshFrame& frame, int k, std::vector<float>& buffer)
+  {
+    buffer.resize(frame.nvertices);
+    for (int i = 0; i < frame.nvertices; ++i)
+      buffer[i] = frame.data[static_cast<size_t>(i) * frame.stride + 3 + k];
+    return buffer.empty() ? 0 : &buffer[0];
+  }
+
+  // property names of PLY can not contain brackets
+  std::string plyName(const std::string& name)
+  {
+    std::string result;
+    for (size_t i = 0; i < name.size(); ++i) {
+      if (name[i] == '[') result += '_';
+      else if (name[i] != ']') result += name[i];
+    }
+    return result;
+  }
+}
+
+std::string MeshWriter::frameFileName(const MeshFrame& frame, const std::string& extension) const
+{
+  std::ostringstream name;
+  name << m_fileNameTemplate << "." << frame.index << "." << extension;
+  return name.str();
+}
+
+std::string MeshWriter::facesFileName(const MeshFrame& frame, const std::string& extension) const
+{
+  std::ostringstream name;
+  name << m_fileNameTemplate << ".faces." << frame.index << "." << extension;
+  return name.str();
+}
+
+MeshWriter* createMeshWriter(const std::string& format, const std::string& fileNameTemplate,
+                             const QuantizationOptions& quantization)
+{
+  if (format == "obj")
+    return new ObjMeshWriter(fileNameTemplate);
+  if (format == "vtp" || format == "vtp/shared")
+    return new VtpMeshWriter(fileNameTemplate, format == "vtp/shared");
+  if (format == "ply" || format == "ply/shared")
+    return new PlyMeshWriter(fileNameTemplate, format == "ply/shared");
+  if (format == "traj")
+    return new TrajMeshWriter(fileNameTemplate, quantization);
+  return 0;
+}
+
+// ObjMeshWriter
+
+void ObjMeshWriter::write(const MeshFrame& frame)
+{
+  std::ofstream file;
+  openOutput(file, frameFileName(frame, "obj"));
+  file << "# Generate by FixDumpMesh" << std::endl;
+  if (!m_attributeNames.empty()) {
+    file << "# vertex columns: x y z";
+    for (size_t k = 0; k < m_attributeNames.size(); ++k)
+      file << " " << m_attributeNames[k];
+    file << std::endl;
+  }
+
+  if (m_objects.empty()) {
+    MeshObject mesh = {"Mesh", 0, frame.nvertices, 0, static_cast<int>(m_faces.size() / 3)};
+    writeObject(file, frame, mesh);
+  } else {
+    for (size_t i = 0; i < m_objects.size(); ++i)
+      writeObject(file, frame, m_objects[i]);
+  }
+  if (!file)
+    throw std::runtime_error("could not write output file " + frameFileName(frame, "obj"));
+}
+
+void ObjMeshWriter::writeObject(std::ofstream& file, const MeshFrame& frame, const MeshObject& object) const
+{
+  file << "o " + object.name << "\n";
+
+  // write vertices, they are already ordered by vertex index
+  const float* pPoints = frame.data;
+  for (int i = object.firstVertex; i < object.firstVertex + object.nvertices; ++i) {
+    const float* p = pPoints + static_cast<size_t>(i) * frame.stride;
+    file << "v " << std::fixed << p[0] << " " << p[1] << " " << p[2];
+    for (int k = 3; k < frame.stride; ++k)
+      file << " " << p[k];
+    file << "\n";
+  }
+
+  // write triangles, vertices are unwrapped so every face is intact
+  for (size_t i = 3 * object.firstFace; i < 3 * static_cast<size_t>(object.firstFace + object.nfaces); i += 3) {
+    file << "f " << m_faces[i] + 1 << " " << m_faces[i + 1] + 1 << " " << m_faces[i + 2] + 1 << "\n";
+  }
+}
+
+// VtpMeshWriter
+
+VtpMeshWriter::VtpMeshWriter(const std::string& fileNameTemplate, bool sharedFaces)
+: MeshWriter(fileNameTemplate), m_sharedFaces(sharedFaces), m_facesPending(false)
+{
+  std::string pvdName = m_fileNameTemplate + ".pvd";
+  m_pvd.open(pvdName.c_str(), std::ios::in | std::ios::out | std::ios::trunc);
+  if (!m_pvd.is_open())
+    throw std::runtime_error("could not open output file " + pvdName);
+  m_pvd << "<?xml version=\"1.0\"?>\n"
+        << "<VTKFile type=\"Collection\" version=\"0.1\">\n"
+        << "  <Collection>\n";
+  m_pvdTail = m_pvd.tellp();
+  m_pvd << "  </Collection>\n</VTKFile>\n";
+  m_pvd.flush();
+}
+
+void VtpMeshWriter::setFaces(const std::vector<int>& faces)
+{
+  MeshWriter::setFaces(faces);
+
+  // appended raw blocks are [UInt32 number of bytes, data]
+  std::vector<int32_t> offsets(faces.size() / 3);
+  for (size_t i = 0; i < offsets.size(); ++i)
+    offsets[i] = static_cast<int32_t>(3 * (i + 1));
+  std::vector<int32_t> connectivity(faces.begin(), faces.end());
+
+  m_polys.clear();
+  uint32_t nbytes = connectivity.size() * sizeof(int32_t);
+  append(m_polys, &nbytes, 1);
+  if (!connectivity.empty())
+    append(m_polys, &connectivity[0], connectivity.size());
+  nbytes = offsets.size() * sizeof(int32_t);
+  append(m_polys, &nbytes, 1);
+  if (!offsets.empty())
+    append(m_polys, &offsets[0], offsets.size());
+  m_facesPending = true;
+}
+
+void VtpMeshWriter::write(const MeshFrame& frame)
+{
+  if (m_sharedFaces && m_facesPending)
+    writeFile(facesFileName(frame, "vtp"), frame, true);
+  m_facesPending = false;
+
+  std::string fileName = frameFileName(frame, "vtp");
+  writeFile(fileName, frame, !m_sharedFaces);
+
+  // insert the frame before closing tags of the collection
+  m_pvd.seekp(m_pvdTail);
+  m_pvd << "    <DataSet timestep=\"" << frame.timestep << "\" file=\"" << baseName(fileName) << "\"/>\n";
+  m_pvdTail = m_pvd.tellp();
+  m_pvd << "  </Collection>\n</VTKFile>\n";
+  m_pvd.flush();
+}
+
+void VtpMeshWriter::writeFile(const std::string& fileName, const MeshFrame& frame, bool withPolys) const
+{
+  std::ofstream file;
+  openOutput(file, fileName);
+
+  std::vector<float> buffer;
+  const float* positions = packPositions(frame, buffer);
+  uint32_t pointBytes = 3 * sizeof(float) * static_cast<uint32_t>(frame.nvertices);
+  uint32_t attributeBytes = sizeof(float) * static_cast<uint32_t>(frame.nvertices);
+  int nattributes = frame.stride - 3;
+  size_t nfaces = withPolys ? m_faces.size() / 3 : 0;
+  size_t attributesOffset = sizeof(uint32_t) + pointBytes;
+  size_t connectivityOffset = attributesOffset + nattributes * (sizeof(uint32_t) + attributeBytes);
+  size_t offsetsOffset = connectivityOffset + sizeof(uint32_t) + m_faces.size() * sizeof(int32_t);
+
+  file << "<?xml version=\"1.0\"?>\n"
+       << "<VTKFile type=\"PolyData\" version=\"0.1\" byte_order=\""
+       << (isLittleEndian() ? "LittleEndian" : "BigEndian") << "\" header_type=\"UInt32\">\n"
+       << "  <PolyData>\n"
+       << "    <Piece NumberOfPoints=\"" << frame.nvertices << "\" NumberOfVerts=\"0\" NumberOfLines=\"0\""
+       << " NumberOfStrips=\"0\" NumberOfPolys=\"" << nfaces << "\">\n";
+  if (nattributes) {
+    file << "      <PointData>\n";
+    for (int k = 0; k < nattributes; ++k) {
+      std::string name = k < (int)m_attributeNames.size() ? m_attributeNames[k] : "attribute";
+      file << "        <DataArray type=\"Float32\" Name=\"" << name << "\" format=\"appended\" offset=\""
+           << attributesOffset + k * (sizeof(uint32_t) + attributeBytes) << "\"/>\n";
+    }
+    file << "      </PointData>\n";
+  }
+  file << "      <Points>\n"
+       << "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"0\"/>\n"
+       << "      </Points>\n";
+  if (withPolys) {
+    file << "      <Polys>\n"
+         << "        <DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\""
+         << connectivityOffset << "\"/>\n"
+         << "        <DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\""
+         << offsetsOffset << "\"/>\n"
+         << "      </Polys>\n";
+  }
+  file << "    </Piece>\n"
+       << "  </PolyData>\n"
+       << "  <AppendedData encoding=\"raw\">\n   _";
+  file.write(reinterpret_cast<const char*>(&pointBytes), sizeof(pointBytes));
+  if (pointBytes)
+    file.write(reinterpret_cast<const char*>(positions), pointBytes);
+  for (int k = 0; k < nattributes; ++k) {
+    file.write(reinterpret_cast<const char*>(&attributeBytes), sizeof(attributeBytes));
+    if (attributeBytes)
+      file.write(reinterpret_cast<const char*>(packAttribute(frame, k, buffer)), attributeBytes);
+  }
+  if (withPolys && !m_polys.empty())
+    file.write(&m_polys[0], m_polys.size());
+  file << "\n  </AppendedData>\n</VTKFile>\n";
+  if (!file)
+    throw std::runtime_error("could not write output file " + fileName);
+}
+
+// PlyMeshWriter
+
+void PlyMeshWriter::setFaces(const std::vector<int>& faces)
+{
+  MeshWriter::setFaces(faces);
+
+  // each face is [uchar 3, int32 i1, i2, i3]
+  m_faceBlock.clear();
+  m_faceBlock.reserve(faces.size() / 3 * (1 + 3 * sizeof(int32_t)));
+  const unsigned char three = 3;
+  for (size_t i = 0; i < faces.size(); i += 3) {
+    int32_t vi[3] = {faces[i], faces[i + 1], faces[i + 2]};
+    append(m_faceBlock, &three, 1);
+    append(m_faceBlock, vi, 3);
+  }
+  m_facesPending = true;
+}
+
+void PlyMeshWriter::write(const MeshFrame& frame)
+{
+  if (m_sharedFaces && m_facesPending)
+    writeFile(facesFileName(frame, "ply"), frame, true);
+  m_facesPending = false;
+  writeFile(frameFileName(frame, "ply"), frame, !m_sharedFaces);
+}
+
+void PlyMeshWriter::writeFile(const std::string& fileName, const MeshFrame& frame, bool withFaces) const
+{
+  std::ofstream file;
+  openOutput(file, fileName);
+
+  file << "ply\n"
+       << "format " << (isLittleEndian() ? "binary_little_endian" : "binary_big_endian") << " 1.0\n"
+       << "comment Generate by FixDumpMesh, timestep " << frame.timestep << "\n"
+       << "element vertex " << frame.nvertices << "\n"
+       << "property float x\nproperty float y\nproperty float z\n";
+  for (int k = 3; k < frame.stride; ++k)
+    file << "property float " << (k - 3 < (int)m_attributeNames.size() ? plyName(m_attributeNames[k - 3]) : "attribute") << "\n";
+  if (withFaces) {
+    file << "element face " << m_faces.size() / 3 << "\n"
+         << "property list uchar int vertex_indices\n";
+  }
+  file << "end_header\n";
+  // vertex properties are interleaved like the frame data
+  if (frame.nvertices)
+    file.write(reinterpret_cast<const char*>(frame.data), frame.stride * sizeof(float) * static_cast<size_t>(frame.nvertices));
+  if (withFaces && !m_faceBlock.empty())
+    file.write(&m_faceBlock[0], m_faceBlock.size());
+  if (!file)
+    throw std::runtime_error("could not write output file " + fileName);
+}
+
+// TrajMeshWriter
+
+TrajMeshWriter::TrajMeshWriter(const std::string& fileNameTemplate, const QuantizationOptions& quantization)
+: MeshWriter(fileNameTemplate), m_trajectory(fileNameTemplate + ".traj"), m_topologyPending(false), m_encoder(0)
+{
+  if (quantization.enabled)
+    m_encoder = new QuantizedFrameEncoder(quantization);
+}
+
+TrajMeshWriter::~TrajMeshWriter()
+{
+  delete m_encoder;
+}
+
+void TrajMeshWriter::setAttributeNames(const std::vector<std::string>& names)
+{
+  MeshWriter::setAttributeNames(names);
+  m_trajectory.writeAttributeNames(names);
+}
+
+void TrajMeshWriter::setFaces(const std::vector<int>& faces)
+{
+  MeshWriter::setFaces(faces);
+  m_topologyPending = true; // number of vertices is known only with the frame
+}
+
+void TrajMeshWriter::write(const MeshFrame& frame)
+{
+  if (m_topologyPending) {
+    m_trajectory.writeTopology(frame.timestep, frame.nvertices, m_faces);
+    m_topologyPending = false;
+  }
+  if (m_encoder) {
+    bool delta = m_encoder->encode(frame.nvertices, frame.stride, frame.data, frame.boxlo, frame.boxhi, m_payload);
+    m_trajectory.writeFrame(frame.timestep, frame.nvertices, frame.stride, MeshTrajectory::QUANTIZED16,
+                            m_payload.empty() ? 0 : &m_payload[0], m_payload.size(),
+                            delta ? MeshTrajectory::DELTA : 0);
+  } else {
+    m_trajectory.writeFrame(frame.timestep, frame.nvertices, frame.stride, frame.data);
+  }
+}
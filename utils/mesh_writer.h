@@ -0,0 +1,195 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef MESH_WRITER_H_
+#define MESH_WRITER_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+#include "mesh_trajectory.h"
+
+/**
+ * Vertex data of one mesh frame, vertices are ordered by vertex index.
+ * Each vertex has stride floats, first three of them are x, y, z, the rest are attributes.
+ */
+struct MeshFrame
+{
+  int64_t timestep;
+  int64_t index; // frame number used in file names
+  int nvertices;
+  int stride;
+  const float* data;
+  double boxlo[3], boxhi[3]; // domain bounding box
+};
+
+/**
+ * Named part of the mesh, vertices and faces of an object are contiguous
+ * and faces refer only to vertices of their object.
+ */
+struct MeshObject
+{
+  std::string name;
+  int firstVertex, nvertices;
+  int firstFace, nfaces; // in triangles
+};
+
+/**
+ * @class
+ *  Base class for writers of triangle meshes used by FixDumpMesh, lives only on the writer proc.
+ *  Faces are linearized triangles of vertex indices, they are passed once before the first frame.
+ *  Names of vertex attributes (floats after x, y, z) are passed once before everything else.
+ *  Objects are passed together with faces, writers which do not support them write one mesh.
+ *  Errors are reported by throwing std::runtime_error.
+ *  Example:
+ *    MeshWriter* writer = createMeshWriter("vtp", "mesh");
+ *    writer->setFaces(faces);
+ *    writer->write(frame);
+ *    delete writer;
+ */
+class MeshWriter
+{
+protected:
+  std::string m_fileNameTemplate;
+  std::vector<int> m_faces;
+  std::vector<std::string> m_attributeNames;
+  std::vector<MeshObject> m_objects;
+public:
+  explicit MeshWriter(const std::string& fileNameTemplate)
+  : m_fileNameTemplate(fileNameTemplate)
+  {
+  }
+
+  virtual ~MeshWriter() {}
+
+  virtual void setFaces(const std::vector<int>& faces) { m_faces = faces; }
+
+  virtual void setAttributeNames(const std::vector<std::string>& names) { m_attributeNames = names; }
+
+  virtual void setObjects(const std::vector<MeshObject>& objects) { m_objects = objects; }
+
+  virtual void write(const MeshFrame& frame) = 0;
+
+  /**
+   * @return
+   *  file name of the frame, template.index.extension
+   */
+  std::string frameFileName(const MeshFrame& frame, const std::string& extension) const;
+
+  /**
+   * @return
+   *  file name of the faces used from the frame on, template.faces.index.extension
+   */
+  std::string facesFileName(const MeshFrame& frame, const std::string& extension) const;
+
+private:
+  MeshWriter(const MeshWriter&);
+  MeshWriter& operator=(const MeshWriter&);
+};
+
+/**
+ * @class
+ *  ASCII Wavefront OBJ, one file per frame. Attributes are written as extra columns of vertices,
+ *  their names are listed in a comment. Every object is written as "o name" followed by
+ *  its vertices and faces.
+ */
+class ObjMeshWriter : public MeshWriter
+{
+public:
+  explicit ObjMeshWriter(const std::string& fileNameTemplate)
+  : MeshWriter(fileNameTemplate)
+  {
+  }
+
+  void write(const MeshFrame& frame);
+
+private:
+  void writeObject(std::ofstream& file, const MeshFrame& frame, const MeshObject& object) const;
+};
+
+/**
+ * @class
+ *  VTK XML PolyData (.vtp) with raw appended binary data, one file per frame.
+ *  Attributes are written as PointData arrays.
+ *  Connectivity is serialized once in setFaces. Without shared faces it is copied to every frame,
+ *  so every frame can be opened alone. With shared faces it is written only into
+ *  template.faces.N.vtp together with points of frame N, the first frame after setFaces,
+ *  and frames hold only points and point data, so template.pvd alone shows a point cloud,
+ *  scripts/mesh_shared_faces.py attaches the faces.
+ *  Frames are listed in template.pvd collection which can be opened in ParaView.
+ */
+class VtpMeshWriter : public MeshWriter
+{
+  std::vector<char> m_polys; // appended connectivity and offsets blocks
+  std::fstream m_pvd;
+  std::streampos m_pvdTail; // position of the collection closing tags
+  bool m_sharedFaces, m_facesPending;
+public:
+  VtpMeshWriter(const std::string& fileNameTemplate, bool sharedFaces = false);
+
+  void setFaces(const std::vector<int>& faces);
+  void write(const MeshFrame& frame);
+
+private:
+  void writeFile(const std::string& fileName, const MeshFrame& frame, bool withPolys) const;
+};
+
+/**
+ * @class
+ *  Binary PLY, one file per frame. Face block is serialized once in setFaces.
+ *  Attributes are float properties of vertices.
+ *  With shared faces the face block is written only into template.faces.N.ply together with
+ *  vertices of frame N, the first frame after setFaces, and frames hold only vertices,
+ *  scripts/mesh_shared_faces.py --format ply --join writes frames with faces.
+ */
+class PlyMeshWriter : public MeshWriter
+{
+  std::vector<char> m_faceBlock;
+  bool m_sharedFaces, m_facesPending;
+public:
+  PlyMeshWriter(const std::string& fileNameTemplate, bool sharedFaces = false)
+  : MeshWriter(fileNameTemplate), m_sharedFaces(sharedFaces), m_facesPending(false)
+  {
+  }
+
+  void setFaces(const std::vector<int>& faces);
+  void write(const MeshFrame& frame);
+
+private:
+  void writeFile(const std::string& fileName, const MeshFrame& frame, bool withFaces) const;
+};
+
+/**
+ * @class
+ *  All frames in one appendable file template.traj, see mesh_trajectory.h for the layout.
+ *  Topology is written before the first frame and after every setFaces.
+ *  Positions are quantized if quantization is enabled.
+ */
+class TrajMeshWriter : public MeshWriter
+{
+  MeshTrajectoryWriter m_trajectory;
+  bool m_topologyPending;
+  QuantizedFrameEncoder* m_encoder; // 0 if frames are not quantized
+  std::vector<char> m_payload;
+public:
+  TrajMeshWriter(const std::string& fileNameTemplate, const QuantizationOptions& quantization);
+  ~TrajMeshWriter();
+
+  void setFaces(const std::vector<int>& faces);
+  void setAttributeNames(const std::vector<std::string>& names);
+  void write(const MeshFrame& frame);
+};
+
+/**
+ * @param quantization
+ *  used only by traj
+ * @return
+ *  new writer for format obj, vtp, vtp/shared, ply, ply/shared or traj, 0 if format is unknown,
+ *  shared formats write faces once into a separate file
+ */
+MeshWriter* createMeshWriter(const std::string& format, const std::string& fileNameTemplate,
+                             const QuantizationOptions& quantization = QuantizationOptions());
+
+#endif /* MESH_WRITER_H_ */
@@ -0,0 +1,106 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "multi_tau_correlator.h"
+#include <algorithm>
+#include <assert.h>
+
+MultiTauCorrelator::MultiTauCorrelator(int nchannels, int p, int m, int nlevels)
+: m_nchannels(nchannels), m_p(p), m_m(m), m_nlevels(nlevels)
+{
+  assert(nchannels > 0 && m > 0 && p >= m && p % m == 0 && nlevels > 0);
+  m_shift.resize(static_cast<size_t>(nlevels) * p * nchannels);
+  m_correlation.resize(m_shift.size());
+  m_accumulator.resize(static_cast<size_t>(nlevels) * nchannels);
+  m_ncorrelation.resize(static_cast<size_t>(nlevels) * p);
+  m_ninserted.resize(nlevels);
+  m_naccumulator.resize(nlevels);
+  m_insertIndex.resize(nlevels);
+  reset();
+}
+
+void MultiTauCorrelator::reset()
+{
+  std::fill(m_shift.begin(), m_shift.end(), 0.0);
+  std::fill(m_correlation.begin(), m_correlation.end(), 0.0);
+  std::fill(m_accumulator.begin(), m_accumulator.end(), 0.0);
+  std::fill(m_ncorrelation.begin(), m_ncorrelation.end(), 0);
+  std::fill(m_ninserted.begin(), m_ninserted.end(), 0);
+  std::fill(m_naccumulator.begin(), m_naccumulator.end(), 0);
+  std::fill(m_insertIndex.begin(), m_insertIndex.end(), 0);
+}
+
+void MultiTauCorrelator::add(const double* sample)
+{
+  add(sample, 0);
+}
+
+void MultiTauCorrelator::add(const double* sample, int level)
+{
+  if (level == m_nlevels)
+    return;
+
+  const int nch = m_nchannels;
+  const int ins = m_insertIndex[level];
+  double* newest = &m_shift[shiftIndex(level, ins)];
+  std::copy(sample, sample + nch, newest);
+  ++m_ninserted[level];
+
+  // pass the block average to the next level
+  double* acc = &m_accumulator[static_cast<size_t>(level) * nch];
+  for (int c = 0; c < nch; ++c)
+    acc[c] += sample[c];
+  if (++m_naccumulator[level] == m_m) {
+    for (int c = 0; c < nch; ++c)
+      acc[c] /= m_m;
+    add(acc, level + 1);
+    std::fill(acc, acc + nch, 0.0);
+    m_naccumulator[level] = 0;
+  }
+
+  // correlate the newest value with the ones stored on this level,
+  // lags below p/m are already covered by the previous level
+  int jfirst = (level == 0) ? 0 : m_p / m_m;
+  int jlast = static_cast<int>(std::min<long>(m_p, m_ninserted[level]));
+  for (int j = jfirst; j < jlast; ++j) {
+    int index = ins - j;
+    if (index < 0) index += m_p;
+    const double* older = &m_shift[shiftIndex(level, index)];
+    double* corr = &m_correlation[shiftIndex(level, j)];
+    for (int c = 0; c < nch; ++c)
+      corr[c] += newest[c] * older[c];
+    ++m_ncorrelation[static_cast<size_t>(level) * m_p + j];
+  }
+
+  m_insertIndex[level] = (ins + 1) % m_p;
+}
+
+void MultiTauCorrelator::getLags(std::vector<long>& lags) const
+{
+  lags.clear();
+  long scale = 1;
+  for (int level = 0; level < m_nlevels; ++level, scale *= m_m) {
+    int jfirst = (level == 0) ? 0 : m_p / m_m;
+    for (int j = jfirst; j < m_p; ++j) {
+      if (m_ncorrelation[static_cast<size_t>(level) * m_p + j] > 0)
+        lags.push_back(j * scale);
+    }
+  }
+}
+
+void MultiTauCorrelator::getCorrelation(std::vector<double>& correlation) const
+{
+  correlation.clear();
+  for (int level = 0; level < m_nlevels; ++level) {
+    int jfirst = (level == 0) ? 0 : m_p / m_m;
+    for (int j = jfirst; j < m_p; ++j) {
+      long n = m_ncorrelation[static_cast<size_t>(level) * m_p + j];
+      if (n == 0)
+        continue;
+      const double* corr = &m_correlation[shiftIndex(level, j)];
+      for (int c = 0; c < m_nchannels; ++c)
+        correlation.push_back(corr[c] / n);
+    }
+  }
+}
@@ -0,0 +1,66 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef MULTI_TAU_CORRELATOR_H_
+#define MULTI_TAU_CORRELATOR_H_
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * @class
+ *  Multiple-tau (logarithmic block) correlator for a set of independent channels.
+ *  Computes time autocorrelation <A(t0) A(t0 + t)> for every channel using
+ *  O(nlevels * p) memory per channel instead of storing the whole time series.
+ *  Level 0 keeps lags 0..p-1, level k keeps lags (p/m..p-1)*m^k, input of
+ *  level k+1 is the average of m consecutive values of level k.
+ *  See Ramirez et al, J. Chem. Phys. 133, 154103 (2010).
+ *  Example:
+ *    MultiTauCorrelator corr(nbins, 16, 2, 20);
+ *    for (each sample) corr.add(&sample[0]);
+ *    corr.getLags(lags);
+ *    corr.getCorrelation(values); // values[ilag * nbins + ibin]
+ */
+class MultiTauCorrelator
+{
+  int m_nchannels, m_p, m_m, m_nlevels;
+  std::vector<double> m_shift;        // [level][p][channel], values in the lag window
+  std::vector<double> m_correlation;  // [level][p][channel]
+  std::vector<double> m_accumulator;  // [level][channel]
+  std::vector<long> m_ncorrelation;   // [level][p]
+  std::vector<long> m_ninserted;      // [level]
+  std::vector<int> m_naccumulator;    // [level]
+  std::vector<int> m_insertIndex;     // [level]
+public:
+  MultiTauCorrelator(int nchannels, int p, int m, int nlevels);
+
+  /**
+   * @param sample
+   *  array of nchannels values taken at the next time point
+   */
+  void add(const double* sample);
+
+  void reset();
+
+  int getNumChannels() const { return m_nchannels; }
+
+  /**
+   * lags in units of the sampling interval, only lags with collected statistics are returned
+   */
+  void getLags(std::vector<long>& lags) const;
+
+  /**
+   * correlation values for lags from getLags, linearized as [lag][channel]
+   */
+  void getCorrelation(std::vector<double>& correlation) const;
+
+private:
+  void add(const double* sample, int level);
+  size_t shiftIndex(int level, int j) const { return (static_cast<size_t>(level) * m_p + j) * m_nchannels; }
+
+  MultiTauCorrelator(const MultiTauCorrelator&);
+  MultiTauCorrelator& operator=(const MultiTauCorrelator&);
+};
+
+#endif /* MULTI_TAU_CORRELATOR_H_ */
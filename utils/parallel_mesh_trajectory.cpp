@@ -0,0 +1,172 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "parallel_mesh_trajectory.h"
+#include <stdexcept>
+#include <cstring>
+
+using namespace MeshTrajectory;
+
+namespace {
+  template<class T>
+  void append(std::vector<char>& buffer, T value)
+  {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+
+  void appendRecordHeader(std::vector<char>& buffer, const char* kind, uint32_t flags,
+                          int64_t timestep, uint64_t payloadBytes)
+  {
+    buffer.insert(buffer.end(), kind, kind + 4);
+    append(buffer, flags);
+    append(buffer, timestep);
+    append(buffer, payloadBytes);
+  }
+}
+
+ParallelMeshTrajectoryWriter::ParallelMeshTrajectoryWriter(const std::string& fileName, MPI_Comm communicator)
+: m_comm(communicator), m_rank(0), m_open(false), m_offset(headerSize), m_topologyOffset(0), m_newTopology(false)
+{
+  MPI_Comm_rank(m_comm, &m_rank);
+  if (MPI_File_open(m_comm, const_cast<char*>(fileName.c_str()), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &m_file) != MPI_SUCCESS)
+    throw std::runtime_error("could not open output file " + fileName);
+  m_open = true;
+  check(MPI_File_set_size(m_file, 0), "could not truncate trajectory file");
+
+  int errorCode = MPI_SUCCESS;
+  if (m_rank == 0) {
+    std::vector<char> header(magic, magic + sizeof(magic));
+    append(header, version);
+    append(header, byteOrderMark);
+    errorCode = MPI_File_write_at(m_file, 0, &header[0], header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  check(errorCode, "could not write trajectory header");
+}
+
+ParallelMeshTrajectoryWriter::~ParallelMeshTrajectoryWriter()
+{
+  try
+  {
+    close();
+  }
+  catch(...)
+  {
+  }
+}
+
+void ParallelMeshTrajectoryWriter::check(int errorCode, const char* what)
+{
+  int failed = errorCode != MPI_SUCCESS, anyFailed = 0;
+  MPI_Allreduce(&failed, &anyFailed, 1, MPI_INT, MPI_MAX, m_comm);
+  if (anyFailed)
+    throw std::runtime_error(what);
+}
+
+void ParallelMeshTrajectoryWriter::writeAttributeNames(const std::vector<std::string>& names)
+{
+  if (m_offset != headerSize)
+    throw std::runtime_error("attribute names must be written before topology and frames");
+
+  std::vector<char> payload;
+  append(payload, static_cast<uint32_t>(names.size()));
+  for (size_t i = 0; i < names.size(); ++i) {
+    append(payload, static_cast<uint32_t>(names[i].size()));
+    payload.insert(payload.end(), names[i].begin(), names[i].end());
+  }
+
+  int errorCode = MPI_SUCCESS;
+  if (m_rank == 0) {
+    std::vector<char> record;
+    appendRecordHeader(record, "ATTR", 0, 0, payload.size());
+    record.insert(record.end(), payload.begin(), payload.end());
+    errorCode = MPI_File_write_at(m_file, m_offset, &record[0], record.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  check(errorCode, "could not write trajectory attribute names");
+  m_offset += recordHeaderSize + payload.size();
+}
+
+void ParallelMeshTrajectoryWriter::writeTopology(int64_t timestep, int64_t nvertices, const std::vector<int>& faces)
+{
+  int64_t nfaces = faces.size() / 3;
+  MPI_Bcast(&nfaces, 1, MPI_INT64_T, 0, m_comm);
+  uint64_t payloadBytes = 2 * sizeof(int64_t) + 3 * nfaces * sizeof(int32_t);
+
+  int errorCode = MPI_SUCCESS;
+  if (m_rank == 0) {
+    std::vector<char> record;
+    record.reserve(recordHeaderSize + payloadBytes);
+    appendRecordHeader(record, "TOPO", 0, timestep, payloadBytes);
+    append(record, nvertices);
+    append(record, nfaces);
+    for (size_t i = 0; i < faces.size(); ++i)
+      append(record, static_cast<int32_t>(faces[i]));
+    errorCode = MPI_File_write_at(m_file, m_offset, &record[0], record.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  check(errorCode, "could not write trajectory topology");
+
+  m_topologyOffset = m_offset;
+  m_offset += recordHeaderSize + payloadBytes;
+  m_newTopology = true;
+}
+
+void ParallelMeshTrajectoryWriter::writeFrame(int64_t timestep, int64_t nvertices, int stride,
+                                              int64_t firstVertex, int64_t nlocalVertices, const float* data)
+{
+  if (!m_open)
+    throw std::runtime_error("trajectory file is closed");
+
+  uint64_t vertexBytes = stride * sizeof(float);
+  uint64_t payloadBytes = framePrefixSize + nvertices * vertexBytes;
+  int errorCode = MPI_SUCCESS;
+  if (m_rank == 0) {
+    std::vector<char> header;
+    appendRecordHeader(header, "FRAM", m_newTopology ? NEW_TOPOLOGY : 0, timestep, payloadBytes);
+    append(header, static_cast<uint32_t>(RAW_FLOAT32));
+    append(header, static_cast<uint32_t>(stride));
+    append(header, nvertices);
+    errorCode = MPI_File_write_at(m_file, m_offset, &header[0], header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+
+    m_indexTimesteps.push_back(timestep);
+    m_indexFrames.push_back(m_offset);
+    m_indexTopologies.push_back(m_topologyOffset);
+  }
+
+  // slabs are contiguous and ordered by rank, so the collective write is one stripe per proc
+  MPI_Offset slabStart = m_offset + recordHeaderSize + framePrefixSize + firstVertex * vertexBytes;
+  int slabErrorCode = MPI_File_write_at_all(m_file, slabStart, const_cast<float*>(data),
+                                            nlocalVertices * stride, MPI_FLOAT, MPI_STATUS_IGNORE);
+  if (errorCode == MPI_SUCCESS)
+    errorCode = slabErrorCode;
+  check(errorCode, "could not write trajectory frame");
+
+  m_offset += recordHeaderSize + payloadBytes;
+  m_newTopology = false;
+}
+
+void ParallelMeshTrajectoryWriter::close()
+{
+  if (!m_open)
+    return;
+  m_open = false;
+
+  int errorCode = MPI_SUCCESS;
+  if (m_rank == 0) {
+    int64_t nframes = m_indexFrames.size();
+    std::vector<char> index;
+    appendRecordHeader(index, "INDX", 0, 0, sizeof(int64_t) + nframes * 3 * sizeof(int64_t));
+    append(index, nframes);
+    for (int64_t i = 0; i < nframes; ++i) {
+      append(index, m_indexTimesteps[i]);
+      append(index, m_indexFrames[i]);
+      append(index, m_indexTopologies[i]);
+    }
+    append(index, m_offset);
+    index.insert(index.end(), indexMagic, indexMagic + sizeof(indexMagic));
+    errorCode = MPI_File_write_at(m_file, m_offset, &index[0], index.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  MPI_File_close(&m_file);
+  check(errorCode, "could not write trajectory index");
+}
@@ -0,0 +1,69 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef PARALLEL_MESH_TRAJECTORY_H_
+#define PARALLEL_MESH_TRAJECTORY_H_
+
+#include "mpi.h"
+#include "mesh_trajectory.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * @class
+ *  Writes mesh trajectory with collective MPI-IO, the file has the same layout as
+ *  the one written by MeshTrajectoryWriter and can be read by MeshTrajectoryReader.
+ *  Every proc owns a contiguous range of vertices and writes only its slab of every frame,
+ *  headers, topology and index are written by root. All methods are collective.
+ *  Errors are reported by throwing std::runtime_error on all procs.
+ */
+class ParallelMeshTrajectoryWriter
+{
+  MPI_Comm m_comm;
+  int m_rank;
+  MPI_File m_file;
+  bool m_open;
+  uint64_t m_offset; // end of the last record, the same on all procs
+  uint64_t m_topologyOffset;
+  bool m_newTopology;
+  std::vector<int64_t> m_indexTimesteps; // only on root
+  std::vector<uint64_t> m_indexFrames, m_indexTopologies; // only on root
+public:
+  ParallelMeshTrajectoryWriter(const std::string& fileName, MPI_Comm communicator);
+  ~ParallelMeshTrajectoryWriter();
+
+  /**
+   * Writes names of vertex attributes, must be called before topology and frames
+   */
+  void writeAttributeNames(const std::vector<std::string>& names);
+
+  /**
+   * @param faces
+   *  used only on root
+   */
+  void writeTopology(int64_t timestep, int64_t nvertices, const std::vector<int>& faces);
+
+  /**
+   * @param firstVertex
+   *  index of the first vertex of this proc slab
+   * @param data
+   *  nlocalVertices * stride floats of vertices [firstVertex, firstVertex + nlocalVertices)
+   */
+  void writeFrame(int64_t timestep, int64_t nvertices, int stride,
+                  int64_t firstVertex, int64_t nlocalVertices, const float* data);
+
+  /**
+   * Writes index and footer and closes the file, called by destructor
+   */
+  void close();
+
+private:
+  void check(int errorCode, const char* what);
+
+  ParallelMeshTrajectoryWriter(const ParallelMeshTrajectoryWriter&);
+  ParallelMeshTrajectoryWriter& operator=(const ParallelMeshTrajectoryWriter&);
+};
+
+#endif /* PARALLEL_MESH_TRAJECTORY_H_ */
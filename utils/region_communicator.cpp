@@ -0,0 +1,103 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#include "region_communicator.h"
+#include "comm.h"
+#include "domain.h"
+#include "neighbor.h"
+#include "region.h"
+
+using namespace LAMMPS_NS;
+
+enum{LAYOUT_UNIFORM,LAYOUT_NONUNIFORM,LAYOUT_TILED};    // several files
+
+RegionCommunicator::RegionCommunicator(LAMMPS* lmp)
+: Pointers(lmp), m_region(0), m_isActive(false), m_willBeActive(false), m_comm(MPI_COMM_NULL)
+{
+}
+
+RegionCommunicator::~RegionCommunicator()
+{
+  if (m_comm != MPI_COMM_NULL)
+    MPI_Comm_free(&m_comm);
+}
+
+void RegionCommunicator::setRegion(Region* region)
+{
+  m_region = region;
+  m_layout.clear();
+}
+
+bool RegionCommunicator::update()
+{
+  if (!evaluate())
+    return false;
+  rebuild();
+  return true;
+}
+
+bool RegionCommunicator::evaluate()
+{
+  // the same on all procs, so either all of them evaluate or none
+  std::vector<double> layout;
+  getLayout(layout);
+  if (layout == m_layout)
+    return false;
+  m_layout.swap(layout);
+
+  m_willBeActive = overlapsSubdomain();
+  int changed = (m_willBeActive != m_isActive) || (m_willBeActive && m_comm == MPI_COMM_NULL), anyChanged = 0;
+  MPI_Allreduce(&changed, &anyChanged, 1, MPI_INT, MPI_MAX, world);
+  return anyChanged != 0;
+}
+
+void RegionCommunicator::rebuild()
+{
+  //in sake of communication performance create communicator for active procs
+  m_isActive = m_willBeActive;
+  if (m_comm != MPI_COMM_NULL)
+    MPI_Comm_free(&m_comm);
+  MPI_Comm_split(world, m_isActive ? 0 : MPI_UNDEFINED, comm->me, &m_comm);
+}
+
+void RegionCommunicator::getLayout(std::vector<double>& layout) const
+{
+  layout.clear();
+  layout.insert(layout.end(), domain->boxlo, domain->boxlo + 3);
+  layout.insert(layout.end(), domain->boxhi, domain->boxhi + 3);
+  if (domain->triclinic)
+    layout.insert(layout.end(), domain->h + 3, domain->h + 6);
+  layout.push_back(comm->layout);
+  if (comm->layout == LAYOUT_TILED) {
+    // rcb subdomains are not described by splits and change only with reneighboring
+    layout.push_back(static_cast<double>(neighbor->lastcall));
+  } else {
+    layout.insert(layout.end(), comm->xsplit, comm->xsplit + comm->procgrid[0] + 1);
+    layout.insert(layout.end(), comm->ysplit, comm->ysplit + comm->procgrid[1] + 1);
+    layout.insert(layout.end(), comm->zsplit, comm->zsplit + comm->procgrid[2] + 1);
+  }
+  layout.push_back(neighbor->skin);
+}
+
+bool RegionCommunicator::overlapsSubdomain() const
+{
+  if (!m_region || !m_region->bboxflag || m_region->dynamic || m_region->varshape || !m_region->interior)
+    return true;
+
+  double lo[3], hi[3];
+  if (domain->triclinic) {
+    domain->bbox(domain->sublo_lamda, domain->subhi_lamda, lo, hi);
+  } else {
+    for (int d = 0; d < 3; ++d) {
+      lo[d] = domain->sublo[d];
+      hi[d] = domain->subhi[d];
+    }
+  }
+
+  // atoms move less than the skin between reneighborings
+  double skin = neighbor->skin;
+  return lo[0] - skin <= m_region->extent_xhi && hi[0] + skin >= m_region->extent_xlo &&
+         lo[1] - skin <= m_region->extent_yhi && hi[1] + skin >= m_region->extent_ylo &&
+         lo[2] - skin <= m_region->extent_zhi && hi[2] + skin >= m_region->extent_zlo;
+}
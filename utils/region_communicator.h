@@ -0,0 +1,82 @@
+//  (C) Copyright Kirill Lykov 2016.
+//
+// Distributed under the GNU Software License (See accompanying file LICENSE)
+
+#ifndef REGION_COMMUNICATOR_H_
+#define REGION_COMMUNICATOR_H_
+
+#include "pointers.h"
+#include <vector>
+
+namespace LAMMPS_NS {
+
+/**
+ * @class
+ *  Communicator of active procs, proc is active if its subdomain extended by the neighbor skin
+ *  overlaps the extent of the region, so it may own atoms in the region until the next reneighboring.
+ *  Regions without extent (bboxflag is 0), dynamic regions and outside regions make all procs active.
+ *  Activity is evaluated again only if the decomposition has changed (box bounds, tilts or
+ *  comm->xsplit/ysplit/zsplit of the brick decomposition, for instance after balance or box change).
+ *  With comm_style tiled subdomains are not described by splits, so activity is evaluated
+ *  after every reneighboring.
+ *  The decomposition is known to all procs, so they agree on it without communication and
+ *  update() is collective on world only when it has changed. The communicator is split again
+ *  only if the set of active procs has changed.
+ *  Example:
+ *    RegionCommunicator regionComm(lmp);
+ *    regionComm.setRegion(region);
+ *    regionComm.update(); // every step, cheap if nothing changed
+ *    if (regionComm.isActive())
+ *      MPI_Reduce(..., regionComm.getComm());
+ *  Pending communication on the old communicator can be finished between the two steps of update():
+ *    if (regionComm.evaluate()) {
+ *      finishPending();
+ *      regionComm.rebuild();
+ *    }
+ */
+class RegionCommunicator : protected Pointers
+{
+  class Region* m_region;
+  bool m_isActive, m_willBeActive;
+  MPI_Comm m_comm; // MPI_COMM_NULL on inactive procs
+  std::vector<double> m_layout; // decomposition at the last evaluation, empty to force it
+public:
+  explicit RegionCommunicator(class LAMMPS* lmp);
+  ~RegionCommunicator();
+
+  void setRegion(class Region* region);
+
+  /**
+   * evaluate() and rebuild() if needed
+   * @return
+   *  true if the communicator was rebuilt
+   */
+  bool update();
+
+  /**
+   * Evaluates activity if the decomposition has changed, collective on world only then
+   * @return
+   *  true if the set of active procs has changed, then rebuild() must be called
+   */
+  bool evaluate();
+
+  /**
+   * Splits the communicator for the activity found by evaluate(), collective on world
+   */
+  void rebuild();
+
+  bool isActive() const { return m_isActive; }
+
+  MPI_Comm getComm() const { return m_comm; }
+
+private:
+  bool overlapsSubdomain() const;
+  void getLayout(std::vector<double>& layout) const;
+
+  RegionCommunicator(const RegionCommunicator&);
+  RegionCommunicator& operator=(const RegionCommunicator&);
+};
+
+}
+
+#endif /* REGION_COMMUNICATOR_H_ */
@@ -2,7 +2,8 @@
 //
 // Distributed under the GNU Software License (See accompanying file LICENSE)
 
-#include "ValueCalculator.h"
+#include "value_calculator.h"
+#include "lazy_reduction.h"
 #include "error.h"
 #include "force.h"
 #include "math_extra.h"
@@ -18,91 +19,187 @@ using namespace LAMMPS_NS;
 
 ValueCalculator::ValueCalculator(class LAMMPS * lmp, int groupbit, int nevery)
 : Pointers(lmp), m_groupbit(groupbit), m_countOfMesurments(0), m_region(0),
-  m_isActive(false), m_atomsCount(0), m_comm(MPI_COMM_NULL),
-  m_root(0), m_firstTimeStep(0), m_nevery(nevery)
+  m_regionComm(lmp), m_atomsCount(0), m_comm(MPI_COMM_NULL),
+  m_root(0), m_firstTimeStep(0), m_nevery(nevery), m_reduction(0)
 {
 }
 
+ValueCalculator::~ValueCalculator()
+{
+  delete m_reduction;
+}
+
 void ValueCalculator::setup()
 {
   //if there are several runs then it is not 0
   m_firstTimeStep = update->ntimestep;
 
   // if subdomain doesn't intersect bounding box for the region
-  // there is no need to run end_of_step. I check it using monte-carlo approach
-  // due to it seems to be natural in lammps
-
-  int igroup = group->find("all");
-  if (igroup == -1) error->all(FLERR,"Could not find fix group ID \"all\"");
-  int all_groupbit = group->bitmask[igroup];
+  // there is no need to run end_of_step
+  m_regionComm.setRegion(m_region);
+  updateCommunicator();
+}
 
-  double** x = atom->x;
+void ValueCalculator::run()
+{
+  run(std::vector<ValueCalculator*>(1, this));
+}
 
-  int *mask = atom->mask;
-  int nlocal = atom->nlocal;
+void ValueCalculator::run(const std::vector<ValueCalculator*>& calculators)
+{
+  if (calculators.empty())
+    return;
+  ValueCalculator* first = calculators[0];
+  Region* region = first->m_region;
+
+  bool isLazy = true, isOutputStep = false;
+  for (size_t k = 0; k < calculators.size(); ++k) {
+    if (calculators[k]->m_region != region)
+      first->error->all(FLERR, "Value calculators sharing a reduction must have the same region");
+    isLazy = isLazy && calculators[k]->isLazy();
+    isOutputStep = isOutputStep || calculators[k]->isOutputStep();
+  }
 
-  for (int i = 0; i < nlocal; i++) {
-    if (mask[i] & all_groupbit) {
-      if (m_region->match(x[i][0], x[i][1], x[i][2])) {
-        m_isActive = true;
-        break;
-      }
-    }
+  // active procs are changed only when the decomposition changes,
+  // pending reductions are completed on the old communicator
+  std::vector<bool> changed(calculators.size(), false);
+  bool anyChanged = false;
+  for (size_t k = 0; k < calculators.size(); ++k) {
+    changed[k] = calculators[k]->m_regionComm.evaluate();
+    anyChanged = anyChanged || changed[k];
+  }
+  if (anyChanged)
+    completeReductions(calculators);
+  for (size_t k = 0; k < calculators.size(); ++k) {
+    if (changed[k])
+      calculators[k]->rebuildCommunicator();
   }
-  m_comm = createCommunicator();
-  assert(m_isActive ? (m_comm != MPI_COMM_NULL) : (m_comm == MPI_COMM_NULL));
-}
 
-void ValueCalculator::run()
-{
-  if (m_isActive) {
-    int countLocal = 0;
-    double** x = atom->x;
+  std::vector<int> offsets;
+  getOffsets(calculators, offsets);
 
-    int *mask = atom->mask;
-    int nlocal = atom->nlocal;
+  // all calculators have the same region so the same procs are active
+  if (first->isActive()) {
+    std::vector<double> localBuffer(offsets.back(), 0.0);
 
-    double localAvgVel[3];
-    memset(localAvgVel, 0, 3 * sizeof(localAvgVel[0]));
+    double** x = first->atom->x;
+    int *mask = first->atom->mask;
+    int nlocal = first->atom->nlocal;
+
+    // region match is expensive, so atoms which are in none of the groups are skipped before it
+    int groupbits = 0;
+    for (size_t k = 0; k < calculators.size(); ++k)
+      groupbits |= calculators[k]->m_groupbit;
 
     for (int i = 0; i < nlocal; i++) {
-      if (mask[i] & m_groupbit) {
-        if (m_region->match(x[i][0], x[i][1], x[i][2])) {
-          calculateLocalValue(i);
-          ++countLocal;
+      if ((mask[i] & groupbits) && region->match(x[i][0], x[i][1], x[i][2])) {
+        for (size_t k = 0; k < calculators.size(); ++k) {
+          if (mask[i] & calculators[k]->m_groupbit) {
+            calculators[k]->calculateLocalValue(i, &localBuffer[offsets[k] + 1]);
+            localBuffer[offsets[k]] += 1.0;
+          }
         }
       }
     }
 
-    int globalCount = 0;
-    assert(m_comm != MPI_COMM_NULL);
-    MPI_Allreduce(&countLocal, &globalCount, 1, MPI_INT, MPI_SUM, m_comm);
-
-    calculateGlobalValue(globalCount);
+    assert(first->m_comm != MPI_COMM_NULL);
+    if (isLazy) {
+      if (first->m_reduction && first->m_reduction->getSize() != offsets.back())
+        completeReductions(calculators);
+      if (!first->m_reduction || first->m_reduction->getSize() != offsets.back()) {
+        delete first->m_reduction;
+        first->m_reduction = new LazyReduction(offsets.back());
+      }
+      if (first->m_reduction->isFull())
+        completeReductions(calculators);
+      first->m_reduction->reduce(&localBuffer[0], first->m_root, first->m_comm);
+      if (isOutputStep)
+        completeReductions(calculators);
+      else
+        first->m_reduction->progress();
+    } else {
+      std::vector<double> globalBuffer(offsets.back(), 0.0);
+      MPI_Allreduce(&localBuffer[0], &globalBuffer[0], offsets.back(), MPI_DOUBLE, MPI_SUM, first->m_comm);
+
+      for (size_t k = 0; k < calculators.size(); ++k) {
+        int globalCount = static_cast<int>(globalBuffer[offsets[k]]);
+        calculators[k]->calculateGlobalValue(globalCount, &globalBuffer[offsets[k] + 1]);
+        calculators[k]->accumulate(globalCount);
+      }
+    }
 
-    if (isRoot()) {
-      m_atomsCount += globalCount;
-      if (update->ntimestep - m_firstTimeStep == m_nevery * m_countOfMesurments) {
+    for (size_t k = 0; k < calculators.size(); ++k) {
+      ValueCalculator* calculator = calculators[k];
+      if (calculator->isOutputStep() && calculator->isRoot()) {
         //time-averaging
-        m_atomsCount /= m_countOfMesurments;
-        writeValue();
+        calculator->m_atomsCount /= calculator->m_countOfMesurments;
+        calculator->writeValue();
       }
     }
   }
-  globalAfterRun();
+
+  for (size_t k = 0; k < calculators.size(); ++k)
+    calculators[k]->globalAfterRun();
+}
+
+void ValueCalculator::completeReductions()
+{
+  completeReductions(std::vector<ValueCalculator*>(1, this));
+}
+
+void ValueCalculator::completeReductions(const std::vector<ValueCalculator*>& calculators)
+{
+  if (calculators.empty() || !calculators[0]->m_reduction)
+    return;
+
+  // results are given only on the root
+  std::vector<double> results;
+  int nresults = calculators[0]->m_reduction->complete(results);
+
+  std::vector<int> offsets;
+  getOffsets(calculators, offsets);
+  for (int sample = 0; sample < nresults; ++sample) {
+    const double* globalBuffer = &results[static_cast<size_t>(sample) * offsets.back()];
+    for (size_t k = 0; k < calculators.size(); ++k) {
+      int globalCount = static_cast<int>(globalBuffer[offsets[k]]);
+      calculators[k]->calculateGlobalValue(globalCount, &globalBuffer[offsets[k] + 1]);
+      calculators[k]->accumulate(globalCount);
+    }
+  }
+}
+
+void ValueCalculator::accumulate(int globalCount)
+{
+  if (isRoot())
+    m_atomsCount += globalCount;
+}
+
+bool ValueCalculator::isOutputStep() const
+{
+  return update->ntimestep - m_firstTimeStep == m_nevery * m_countOfMesurments;
+}
+
+void ValueCalculator::getOffsets(const std::vector<ValueCalculator*>& calculators, std::vector<int>& offsets)
+{
+  // layout of the buffer: for every calculator count of atoms followed by its values
+  offsets.assign(calculators.size() + 1, 0);
+  for (size_t k = 0; k < calculators.size(); ++k)
+    offsets[k + 1] = offsets[k] + 1 + calculators[k]->getReductionSize();
 }
 
 bool ValueCalculator::setRegion(const std::string& regionName)
 {
   int iregion = domain->find_region(const_cast<char*>(regionName.c_str()));
+  if (iregion == -1)
+    return false;
   m_region = domain->regions[iregion];
-
-  return iregion != -1;
+  m_regionComm.setRegion(m_region);
+  return true;
 }
 
 bool ValueCalculator::isRoot() const
 {
-  assert(m_isActive);
+  assert(isActive());
 
   int rankInGroup;
   MPI_Comm_rank(m_comm, &rankInGroup);
@@ -110,12 +207,26 @@ bool ValueCalculator::isRoot() const
   return rankInGroup == m_root;
 }
 
-MPI_Comm ValueCalculator::createCommunicator()
+void ValueCalculator::updateCommunicator()
+{
+  // active procs are changed only when the decomposition changes
+  if (m_regionComm.evaluate())
+    rebuildCommunicator();
+}
+
+void ValueCalculator::rebuildCommunicator()
 {
-  //in sake of communication performance create communicator for active procs
-  MPI_Comm communicator = MPI_COMM_NULL;
-  MPI_Comm_split(world, m_isActive ? 0 : MPI_UNDEFINED , comm->me, &communicator);
-  return communicator;
+  bool wasRoot = isActive() && isRoot();
+  m_regionComm.rebuild();
+  m_comm = m_regionComm.getComm();
+  moveAccumulatedValues(wasRoot);
+}
+
+void ValueCalculator::moveAccumulatedValues(bool wasRoot)
+{
+  int local = wasRoot ? m_atomsCount : 0, global = 0;
+  MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_SUM, world);
+  m_atomsCount = isActive() && isRoot() ? global : 0;
 }
 
 // DensityCalculator
@@ -153,26 +264,38 @@ void DensityCalculator::globalAfterRun()
 VelocityCalculator::VelocityCalculator(class LAMMPS * lmp, int groupbit, int nevery)
 : ValueCalculator(lmp, groupbit, nevery)
 {
-  memset(m_localAvgVel, 0, 3 * sizeof(m_localAvgVel[0]));
   memset(m_avgVel, 0, 3 * sizeof(m_avgVel[0]));
 }
 
-void VelocityCalculator::calculateLocalValue(int i)
+void VelocityCalculator::calculateLocalValue(int i, double* localValue)
 {
-  MathExtra::add3(m_localAvgVel, atom->v[i], m_localAvgVel);
+  MathExtra::add3(localValue, atom->v[i], localValue);
 }
 
-void VelocityCalculator::calculateGlobalValue(int globalCount)
+void VelocityCalculator::calculateGlobalValue(int globalCount, const double* globalValue)
 {
   assert(m_countOfMesurments != 0); // TODO it looks like a bug that m_countOfMesurments is always 0
 
+  if (globalCount == 0)
+    return;
   double globalAvgVel[3];
-  memset(globalAvgVel, 0, 3 * sizeof(globalAvgVel[0]));
-  MPI_Reduce(&m_localAvgVel, &globalAvgVel, 3, MPI_DOUBLE, MPI_SUM, m_root, m_comm);
+  MathExtra::copy3(globalValue, globalAvgVel);
   MathExtra::scale3(1.0 / globalCount, globalAvgVel);
   MathExtra::add3(m_avgVel, globalAvgVel, m_avgVel);
 }
 
+void VelocityCalculator::moveAccumulatedValues(bool wasRoot)
+{
+  ValueCalculator::moveAccumulatedValues(wasRoot);
+
+  double local[3] = {0.0, 0.0, 0.0};
+  if (wasRoot)
+    MathExtra::copy3(m_avgVel, local);
+  MPI_Allreduce(local, m_avgVel, 3, MPI_DOUBLE, MPI_SUM, world);
+  if (!isActive() || !isRoot())
+    memset(m_avgVel, 0, 3 * sizeof(m_avgVel[0]));
+}
+
 void VelocityCalculator::writeValue()
 {
   MathExtra::scale3(1.0 / static_cast<double>(m_countOfMesurments), m_avgVel);
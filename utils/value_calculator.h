@@ -6,55 +6,122 @@
 #define VALUECALCULATOR_H_
 
 #include <string>
+#include <vector>
 #include <assert.h>
 #include "pointers.h"
 #include "region.h"
+#include "region_communicator.h"
+
+class LazyReduction;
 
 namespace LAMMPS_NS {
 
 /**
  * @class
  *  A base class used for all calculations of statistical properties in a specified region.
- *  Communication is only between active cores, core is active if there are particles of the specified
- *  group which belong to this core and to the region.
+ *  Communication is only between active cores, core is active if its subdomain overlaps the region,
+ *  see RegionCommunicator.
+ *  Every subclass contributes getReductionSize() doubles per step, they are packed together with the
+ *  count of atoms into one buffer which is reduced by one collective. Calculators attached to the same
+ *  region can share this collective:
+ *    std::vector<ValueCalculator*> calculators;
+ *    calculators.push_back(&densCalc);
+ *    calculators.push_back(&velCalc);
+ *    ValueCalculator::run(calculators);
+ *  If all calculators of the collective are lazy (values are needed only for the time average),
+ *  it is started with MPI_Ireduce and completed only at the output step, when too many reductions
+ *  are in flight or before the communicator changes. Lazy calculators must be completed after the run:
+ *    ValueCalculator::completeReductions(calculators);
  */
 class ValueCalculator : protected Pointers
 {
 protected:
   int m_countOfMesurments;
   class Region* m_region;
-  bool m_isActive; //if the subdomain of the current proc doesn't contain region, don't do any computations
+  RegionCommunicator m_regionComm; //if the subdomain of the current proc doesn't overlap region, don't do any computations
   std::string m_fileName;
   int m_atomsCount; // atoms for m_countOfMesurments
-  MPI_Comm m_comm;
+  MPI_Comm m_comm; // communicator of active procs, updated in run
   int m_root;
   double m_velDir[3];
   bigint m_firstTimeStep;
   int m_groupbit, m_nevery;
+  LazyReduction* m_reduction; // pending reductions of the collective which starts with this calculator
 
 public:
 
   ValueCalculator(class LAMMPS * lmp, int groupbit, int nevery);
 
-  virtual ~ValueCalculator() {}
+  virtual ~ValueCalculator();
 
   virtual void setup();
 
   virtual void run();
 
+  /**
+   * Runs calculators with one collective, all of them must have the same region
+   */
+  static void run(const std::vector<ValueCalculator*>& calculators);
+
+  /**
+   * Finishes pending reductions of lazy calculators, must be called on all procs
+   */
+  void completeReductions();
+
+  static void completeReductions(const std::vector<ValueCalculator*>& calculators);
+
   virtual bool setRegion(const std::string& regionName);
 
-  virtual bool isActive() const { return m_isActive; }
+  virtual bool isActive() const { return m_regionComm.isActive(); }
 
   virtual bool isRoot() const;
 
 protected:
-  virtual void calculateLocalValue(int i) = 0;
-  virtual void calculateGlobalValue(int globalCount) = 0;
+  /**
+   * @return
+   *  number of doubles reduced in addition to the count of atoms
+   */
+  virtual int getReductionSize() const { return 0; }
+
+  /**
+   * @return
+   *  true if global values are used only on the root at the output step,
+   *  then calculateGlobalValue is called only on the root and may be called later than the step
+   */
+  virtual bool isLazy() const { return false; }
+
+  /**
+   * @param localValue
+   *  getReductionSize() doubles of this proc, zeroed every step
+   */
+  virtual void calculateLocalValue(int i, double* localValue) = 0;
+
+  /**
+   * @param globalValue
+   *  getReductionSize() doubles summed over active procs
+   */
+  virtual void calculateGlobalValue(int globalCount, const double* globalValue) = 0;
   virtual void writeValue() = 0;
   virtual void globalAfterRun() = 0;
 
-  MPI_Comm createCommunicator();
+  /**
+   * Called when active procs have changed, accumulated values of the old root
+   * should be given to the new root
+   */
+  virtual void moveAccumulatedValues(bool wasRoot);
+
+  void updateCommunicator();
+
+  /**
+   * Called after m_regionComm.evaluate() has found that active procs have changed
+   */
+  void rebuildCommunicator();
+
+  void accumulate(int globalCount);
+
+  bool isOutputStep() const;
+
+  static void getOffsets(const std::vector<ValueCalculator*>& calculators, std::vector<int>& offsets);
 
 
   ValueCalculator(ValueCalculator&);
@@ -105,11 +172,11 @@ public:
   }
 
 protected:
-  void calculateLocalValue(int i)
+  void calculateLocalValue(int, double*)
   {
   }
 
-  void calculateGlobalValue(int globalCount)
+  void calculateGlobalValue(int globalCount, const double*)
   {
     assert(m_volume > 0.0);
     m_density = static_cast<double>(globalCount) / m_volume;
@@ -124,23 +191,29 @@ protected:
 
 /**
  * @class
- *  Computes average velocity for the group of atoms in the specified region
+ *  Computes average velocity for the group of atoms in the specified region,
+ *  velocity is needed only for the time average so its reduction is lazy
  */
 class VelocityCalculator : public ValueCalculator
 {
-  double m_localAvgVel[3];
   double m_avgVel[3];
 protected:
 
   VelocityCalculator(class LAMMPS * lmp, int groupbit, int nevery);
 
-  virtual void calculateLocalValue(int i);
+  int getReductionSize() const { return 3; }
 
-  void calculateGlobalValue(int globalCount);
+  bool isLazy() const { return true; }
+
+  virtual void calculateLocalValue(int i, double* localValue);
+
+  void calculateGlobalValue(int globalCount, const double* globalValue);
 
   void writeValue();
 
   void globalAfterRun() {};
+
+  void moveAccumulatedValues(bool wasRoot);
 };
 }
 